@@ -12,6 +12,10 @@
 #include <bits/stdc++.h>
 #include <queue>
 #include <map>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 //----------------------------------------------------------------
 // BEGIN IMPLEMENTATION
@@ -55,31 +59,23 @@ std::tuple<int, bool> Cnf::oneOfClause(int* vars, int length, int &var_id, bool
         return {vars[0], true};
     } else if (length == 2 && beginning) {
         Clause atleast1 = make_small_clause(vars[0], vars[1], true, true);
-        add_clause(atleast1, Cnf::clauses, Cnf::variables);
+        encode_clause(atleast1);
         Clause atmost1 = make_small_clause(vars[0], vars[1], false, false);
-        add_clause(atmost1, Cnf::clauses, Cnf::variables);
+        encode_clause(atmost1);
     } else if (length == 2 || (length == 3 && !beginning)) {
         // define new commander variable if newComm=0, or use newComm
         // if use newComm, don't increment var_id
-        VariableLocations comm;
+        int comm_id = newComm;
         if (newComm == -1) {
-            comm.variable_id = var_id;
-            comm.clauses_containing = new std::vector<int>();
-            Cnf::true_assignment_statuses[var_id] = 'u';
-            Cnf::false_assignment_statuses[var_id] = 'u';
-            Cnf::variables[var_id] = comm;
-            var_id++;
-        } else {
-            comm = Cnf::variables[newComm];
+            comm_id = new_auxiliary_variable(var_id);
         }
-        int comm_id = comm.variable_id;
         bool comm_sign = newComm == -1 ? true : newCommSign;
 
         // pairwise distinct
         for (int i = 0; i < length; i++) {
             for (int j = 0; j < i; j++) {
                 Clause unequal = make_small_clause(vars[j], vars[i], false, false);
-                add_clause(unequal, Cnf::clauses, Cnf::variables);
+                encode_clause(unequal);
             }
         }
         // comm => OR vars
@@ -102,11 +98,11 @@ std::tuple<int, bool> Cnf::oneOfClause(int* vars, int length, int &var_id, bool
             }
         }
 
-        add_clause(pos_comm, Cnf::clauses, Cnf::variables);
+        encode_clause(pos_comm);
         // not comm => AND not vars
         for (int i = 0; i < length; i++) {
             Clause neg_comm = make_small_clause(vars[i], comm_id, false, comm_sign);
-            add_clause(neg_comm,  Cnf::clauses, Cnf::variables);
+            encode_clause(neg_comm);
         }
 
         return {comm_id, comm_sign};
@@ -116,10 +112,10 @@ std::tuple<int, bool> Cnf::oneOfClause(int* vars, int length, int &var_id, bool
             if (beginning) {
                 auto [comm1, comm1sign] = oneOfClause(vars + 2, length-2, var_id, beginning=false);
                 
-                add_clause(make_small_clause(vars[0], comm1, false, !comm1sign),  Cnf::clauses, Cnf::variables);
-                add_clause(make_small_clause(vars[1], comm1, false, !comm1sign),  Cnf::clauses, Cnf::variables);
-                add_clause(make_small_clause(vars[0], vars[1], false, false),  Cnf::clauses, Cnf::variables);
-                add_clause(make_triple_clause(vars[0], vars[1], comm1, true, true, comm1sign), Cnf::clauses, Cnf::variables);
+                encode_clause(make_small_clause(vars[0], comm1, false, !comm1sign));
+                encode_clause(make_small_clause(vars[1], comm1, false, !comm1sign));
+                encode_clause(make_small_clause(vars[0], vars[1], false, false));
+                encode_clause(make_triple_clause(vars[0], vars[1], comm1, true, true, comm1sign));
             } else {
                 auto [comm1, comm1sign] = oneOfClause(vars + 2, length-2, var_id, beginning=false);
 
@@ -186,7 +182,9 @@ Cnf::Cnf(
         int num_constraints,
         int num_assignments,
         int reduction_method,
-        GridAssignment *assignments) 
+        GridAssignment *assignments,
+        short *encodings,
+        bool use_templates) 
     {
     Cnf::n = n;
     Cnf::num_conflict_to_hold = n * n * n * n;
@@ -195,6 +193,11 @@ Cnf::Cnf(
     Cnf::nprocs = nprocs;
     Cnf::num_vars_assigned = 0;
     Cnf::reduction_method = reduction_method;
+    Cnf::counting_only = false;
+    Cnf::counted_clauses = 0;
+    Cnf::last_reconstruct_incremental = false;
+    Cnf::cube_known = true;
+    resolve_encodings(n, reduction_method, encodings, Cnf::encodings);
 
     int var_id;
 
@@ -203,12 +206,27 @@ Cnf::Cnf(
     for (int i = 0; i < num_constraints; i++) {
         int sum = constraints[i][0];
         int size = constraints[i][1];
-        consVars += n + generatePartitionsNum(sum, size, n);
-        consClauses += n*(size+1) + generatePartitionsNum(sum, size, n)*(size+1) + 1 + n*size*(size-1) / 2;
+        int num_parts = cage_combinations(sum, size, n).size();
+        int uniq_vars;
+        int uniq_clauses;
+        encoding_size(Cnf::encodings[GROUP_CAGE], size, false, &uniq_vars, &uniq_clauses);
+        consVars += n + n*uniq_vars + num_parts;
+        consClauses += n*(size+1) + num_parts*(size+1) + 1 + n*uniq_clauses 
+            + (CAGE_PRESOLVE ? cage_presolve_clauses(sum, size, n) : 0);
+    }
+
+    size_t base_bytes = 0;
+    int *base_image = NULL;
+    if (use_templates) {
+        base_image = map_formula_template(pid, nprocs, n, sqrt_n, 
+            reduction_method, Cnf::encodings, &base_bytes);
     }
 
     // variable/clause sizes are defined in reduction methods. constraints' additions also will be included
-    switch (reduction_method) {
+    if (base_image != NULL) {
+        var_id = reduce_puzzle_template(base_image, num_assignments, assignments, consVars, consClauses);
+        munmap(base_image, base_bytes);
+    } else switch (reduction_method) {
         case (0): {
             reduce_puzzle_original(n, sqrt_n, num_assignments, assignments, consVars, consClauses);
             var_id = n*n*n;
@@ -217,6 +235,11 @@ Cnf::Cnf(
 
             var_id = reduce_puzzle_clauses_truncated(n, sqrt_n, num_assignments, assignments, consVars, consClauses);
             break;
+        } case (2): {
+            var_id = reduce_puzzle_encoded(n, sqrt_n, num_assignments, assignments, consVars, consClauses);
+            break;
+        } default: {
+            raise_error("Unknown reduction method " + std::to_string(reduction_method));
         }
     }
 
@@ -226,6 +249,9 @@ Cnf::Cnf(
         printf("%d clauses added out of %d alloted\n", Cnf::clauses.num_indexed, Cnf::clauses.max_indexable);
         printf("%d variables added out of %d alloted\n", Cnf::num_variables, var_id);
     }
+    // Every reduction sizes the formula exactly
+    assert(Cnf::clauses.num_indexed == Cnf::clauses.max_indexable);
+    assert(var_id == Cnf::num_variables);
     Cnf::depth = 0;
     Cnf::depth_str = "";
     init_compression();
@@ -259,6 +285,10 @@ Cnf::Cnf(
     Cnf::depth_str = "";
     Cnf::num_vars_assigned = 0;
     Cnf::reduction_method = 0;
+    Cnf::counting_only = false;
+    Cnf::counted_clauses = 0;
+    Cnf::last_reconstruct_incremental = false;
+    Cnf::cube_known = true;
     Task recently_undone_assignment;
     Cnf::true_assignment_statuses = (char *)calloc(
         sizeof(char), Cnf::num_variables);
@@ -281,9 +311,278 @@ Cnf::Cnf() {
     Cnf::depth_str = "";
     Cnf::num_vars_assigned = 0;
     Cnf::reduction_method = 0;
+    Cnf::counting_only = false;
+    Cnf::counted_clauses = 0;
+    Cnf::last_reconstruct_incremental = false;
+    Cnf::cube_known = true;
     Task recently_undone_assignment;
 }
 
+// Number of ints in a formula image with this header
+int formula_image_ints(FormulaImageHeader header) {
+    int header_ints = ceil_div(sizeof(FormulaImageHeader), sizeof(int));
+    return header_ints + header.num_clauses + header.num_literals
+        + header.num_variables + header.num_occurrences + 3 * header.n * header.n * header.n
+        + ceil_div(header.num_literals, sizeof(int));
+}
+
+// Path of the cached base formula for a grid size, reduction and encodings
+std::string formula_template_path(int n, int reduction_method, short *encodings) {
+    std::string path = std::string(FORMULA_TEMPLATE_DIR) + "/n" + std::to_string(n) 
+        + "_r" + std::to_string(reduction_method);
+    if (reduction_method == 2) {
+        // Cages are never part of the base formula
+        path += "_e";
+        for (int group_type = GROUP_CELL; group_type <= GROUP_BOX; group_type++) {
+            path += std::to_string(encodings[group_type]);
+        }
+    }
+    return path + ".img";
+}
+
+// Writes an image under a temporary name first, so readers never see half a file
+static bool write_formula_template(std::string path, int *image, int num_ints) {
+    mkdir(FORMULA_TEMPLATE_DIR, 0755);
+    std::string temp_path = path + "." + std::to_string(getpid());
+    FILE *file = fopen(temp_path.c_str(), "wb");
+    if (file == NULL) {
+        return false;
+    }
+    bool written = fwrite(image, sizeof(int), num_ints, file) == (size_t)num_ints;
+    written = (fclose(file) == 0) && written;
+    if (!written || rename(temp_path.c_str(), path.c_str()) != 0) {
+        remove(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Maps a template file, returns NULL when it is missing or does not match
+static int *try_map_formula_template(
+        std::string path,
+        int n, 
+        int reduction_method, 
+        short *encodings, 
+        size_t *num_bytes) 
+    {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || (size_t)file_stat.st_size < sizeof(FormulaImageHeader)) {
+        close(fd);
+        return NULL;
+    }
+    size_t file_bytes = file_stat.st_size;
+    void *mapped = mmap(NULL, file_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return NULL;
+    }
+    FormulaImageHeader header;
+    memcpy(&header, mapped, sizeof(FormulaImageHeader));
+    bool matches = header.magic == FORMULA_IMAGE_MAGIC 
+        && header.version == FORMULA_IMAGE_VERSION
+        && header.n == n
+        && header.reduction_method == reduction_method
+        && sizeof(int) * formula_image_ints(header) == file_bytes;
+    for (int group_type = GROUP_CELL; group_type <= GROUP_BOX; group_type++) {
+        matches = matches && header.encodings[group_type] == encodings[group_type];
+    }
+    if (!matches) {
+        munmap(mapped, file_bytes);
+        return NULL;
+    }
+    *num_bytes = file_bytes;
+    return (int *)mapped;
+}
+
+// Maps a cached base formula, encoding and caching it first on a miss.
+// Returns NULL when the cache can not be used.
+int *map_formula_template(
+        short pid,
+        short nprocs,
+        int n, 
+        int sqrt_n, 
+        int reduction_method, 
+        short *encodings, 
+        size_t *num_bytes) 
+    {
+    std::string path = formula_template_path(n, reduction_method, encodings);
+    int *mapped = try_map_formula_template(path, n, reduction_method, encodings, num_bytes);
+    if (mapped != NULL) {
+        return mapped;
+    }
+    // Missing or stale, encode the base formula without givens or cages
+    Cnf base(pid, nprocs, NULL, n, sqrt_n, 0, 0, reduction_method, NULL, encodings);
+    int num_ints;
+    int *image = base.to_formula_image(&num_ints);
+    base.free_cnf();
+    bool written = write_formula_template(path, image, num_ints);
+    free(image);
+    if (!written) {
+        if (PRINT_LEVEL > 0) printf("Could not write formula template %s\n", path.c_str());
+        return NULL;
+    }
+    return try_map_formula_template(path, n, reduction_method, encodings, num_bytes);
+}
+
+// Serializes the formula into a flat image, returns a malloced copy
+int *Cnf::to_formula_image(int *num_ints) {
+    FormulaImageHeader header;
+    header.magic = FORMULA_IMAGE_MAGIC;
+    header.version = FORMULA_IMAGE_VERSION;
+    header.n = Cnf::n;
+    header.num_variables = Cnf::num_variables;
+    header.num_clauses = Cnf::clauses.num_indexed;
+    header.num_conflict_to_hold = Cnf::num_conflict_to_hold;
+    header.reduction_method = Cnf::reduction_method;
+    for (int group_type = 0; group_type < NUM_GROUP_TYPES; group_type++) {
+        header.encodings[group_type] = Cnf::encodings[group_type];
+    }
+    header.num_literals = 0;
+    for (int clause_id = 0; clause_id < header.num_clauses; clause_id++) {
+        header.num_literals += Cnf::clauses.get_clause_ptr(clause_id)->num_literals;
+    }
+    header.num_occurrences = 0;
+    for (int var_id = 0; var_id < header.num_variables; var_id++) {
+        header.num_occurrences += Cnf::variables[var_id].clauses_containing->size();
+    }
+    int num_cells = Cnf::n * Cnf::n * Cnf::n;
+    int header_ints = ceil_div(sizeof(FormulaImageHeader), sizeof(int));
+    *num_ints = formula_image_ints(header);
+    int *image = (int *)calloc(sizeof(int), *num_ints);
+    memcpy(image, &header, sizeof(FormulaImageHeader));
+    int *clause_sizes = image + header_ints;
+    int *literal_ids = clause_sizes + header.num_clauses;
+    int *occurrence_sizes = literal_ids + header.num_literals;
+    int *occurrences = occurrence_sizes + header.num_variables;
+    int *cells = occurrences + header.num_occurrences;
+    bool *literal_signs = (bool *)(cells + 3 * num_cells);
+    for (int clause_id = 0; clause_id < header.num_clauses; clause_id++) {
+        Clause clause = *Cnf::clauses.get_clause_ptr(clause_id);
+        clause_sizes[clause_id] = clause.num_literals;
+        memcpy(literal_ids, clause.literal_variable_ids, sizeof(int) * clause.num_literals);
+        memcpy(literal_signs, clause.literal_signs, sizeof(bool) * clause.num_literals);
+        literal_ids += clause.num_literals;
+        literal_signs += clause.num_literals;
+    }
+    for (int var_id = 0; var_id < header.num_variables; var_id++) {
+        std::vector<int> *clauses_containing = Cnf::variables[var_id].clauses_containing;
+        occurrence_sizes[var_id] = clauses_containing->size();
+        memcpy(occurrences, clauses_containing->data(), sizeof(int) * clauses_containing->size());
+        occurrences += clauses_containing->size();
+    }
+    // Only the first n^3 variables are cells of the board
+    for (int var_id = 0; var_id < num_cells; var_id++) {
+        cells[3 * var_id] = Cnf::variables[var_id].variable_row;
+        cells[3 * var_id + 1] = Cnf::variables[var_id].variable_col;
+        cells[3 * var_id + 2] = Cnf::variables[var_id].variable_k;
+    }
+    return image;
+}
+
+// Makes CNF formula from an image, without re-encoding anything
+void Cnf::load_formula_image(short pid, short nprocs, int *image) {
+    FormulaImageHeader header;
+    memcpy(&header, image, sizeof(FormulaImageHeader));
+    if (header.magic != FORMULA_IMAGE_MAGIC || header.version != FORMULA_IMAGE_VERSION) {
+        raise_error("Formula image is corrupt");
+    }
+    Cnf::pid = pid;
+    Cnf::nprocs = nprocs;
+    Cnf::n = header.n;
+    Cnf::num_conflict_to_hold = header.num_conflict_to_hold;
+    Cnf::reduction_method = header.reduction_method;
+    for (int group_type = 0; group_type < NUM_GROUP_TYPES; group_type++) {
+        Cnf::encodings[group_type] = header.encodings[group_type];
+    }
+    Cnf::num_vars_assigned = 0;
+    Cnf::counting_only = false;
+    Cnf::counted_clauses = 0;
+    Cnf::last_reconstruct_incremental = false;
+    Cnf::cube_known = true;
+    Cnf::depth = 0;
+    Cnf::depth_str = "";
+    read_formula_image(image, 0, 0);
+    // Compression masks follow from the ids alone, recomputing is cheap
+    init_compression();
+}
+
+// Copies an image's clauses and variables, leaving room for extras.
+// Returns the number of variables in the image.
+int Cnf::read_formula_image(int *image, int numExtraVars, int numExtraClauses) {
+    FormulaImageHeader header;
+    memcpy(&header, image, sizeof(FormulaImageHeader));
+    int num_cells = header.n * header.n * header.n;
+    int header_ints = ceil_div(sizeof(FormulaImageHeader), sizeof(int));
+    int *clause_sizes = image + header_ints;
+    int *literal_ids = clause_sizes + header.num_clauses;
+    int *occurrence_sizes = literal_ids + header.num_literals;
+    int *occurrences = occurrence_sizes + header.num_variables;
+    int *cells = occurrences + header.num_occurrences;
+    bool *literal_signs = (bool *)(cells + 3 * num_cells);
+
+    Cnf::num_variables = header.num_variables + numExtraVars;
+    Cnf::true_assignment_statuses = (char *)calloc(
+        sizeof(char), Cnf::num_variables);
+    Cnf::false_assignment_statuses = (char *)calloc(
+        sizeof(char), Cnf::num_variables);
+    memset(Cnf::true_assignment_statuses, 'u', Cnf::num_variables);
+    memset(Cnf::false_assignment_statuses, 'u', Cnf::num_variables);
+    Cnf::variables = (VariableLocations *)malloc(
+        sizeof(VariableLocations) * Cnf::num_variables);
+    for (int var_id = 0; var_id < header.num_variables; var_id++) {
+        VariableLocations current_variable;
+        // Occurrence lists come prebuilt, so add_clause is not used below
+        current_variable.clauses_containing = new std::vector<int>(
+            occurrences, occurrences + occurrence_sizes[var_id]);
+        occurrences += occurrence_sizes[var_id];
+        current_variable.variable_id = var_id;
+        current_variable.variable_row = var_id < num_cells ? cells[3 * var_id] : -1;
+        current_variable.variable_col = var_id < num_cells ? cells[3 * var_id + 1] : -1;
+        current_variable.variable_k = var_id < num_cells ? cells[3 * var_id + 2] : -1;
+        Cnf::variables[var_id] = current_variable;
+    }
+    Clauses clauses(header.num_clauses + numExtraClauses, Cnf::num_conflict_to_hold);
+    Cnf::clauses = clauses;
+    Cnf::clause_hash.reserve(header.num_clauses + numExtraClauses);
+    for (int clause_id = 0; clause_id < header.num_clauses; clause_id++) {
+        Clause new_clause;
+        new_clause.num_literals = clause_sizes[clause_id];
+        new_clause.literal_variable_ids = (int *)malloc(sizeof(int) * new_clause.num_literals);
+        new_clause.literal_signs = (bool *)malloc(sizeof(bool) * new_clause.num_literals);
+        memcpy(new_clause.literal_variable_ids, literal_ids, sizeof(int) * new_clause.num_literals);
+        memcpy(new_clause.literal_signs, literal_signs, sizeof(bool) * new_clause.num_literals);
+        literal_ids += new_clause.num_literals;
+        literal_signs += new_clause.num_literals;
+        new_clause.id = clause_id;
+        Cnf::clauses.add_regular_clause(new_clause);
+        Cnf::clauses.num_unsats[clause_id] = new_clause.num_literals;
+        Cnf::clause_hash.insert(new_clause);
+    }
+    return header.num_variables;
+}
+
+// Base formula from a cached template, then the givens
+int Cnf::reduce_puzzle_template(
+        int *base_image, 
+        int num_assignments,
+        GridAssignment *assignments,
+        int numExtraVars, 
+        int numExtraClauses) 
+    {
+    // Every reduction adds its givens last, so the result matches it exactly
+    int variable_id = read_formula_image(base_image, numExtraVars, num_assignments + numExtraClauses);
+    for (int i = 0; i < num_assignments; i++) {
+        int given = getRegularVariable(assignments[i].row, assignments[i].col, assignments[i].value, Cnf::n);
+        bool sign = true;
+        encode_clause(&given, &sign, 1);
+    }
+    return variable_id;
+}
+
 int Cnf::reduce_puzzle_clauses_truncated(int n, int sqrt_n, int num_assignments, GridAssignment *assignments, int numExtraVars, int numExtraClauses) {
     int n_squ = n * n;
     Cnf::num_variables = std::pow(n,3) + n*n*sqrt_n*comm_num_vars(sqrt_n, false) + 2*n*n*(comm_num_vars(sqrt_n) + comm_num_vars(n)) + numExtraVars;
@@ -400,42 +699,73 @@ int Cnf::reduce_puzzle_clauses_truncated(int n, int sqrt_n, int num_assignments,
     return variable_id; // to keep track what var for constraints
 }
 
-// generate all distinct parts using #s in [1, max]
-std::vector<std::vector<int>> Cnf::generatePartitions(int sum, int size, int max) {
-    std::vector<std::vector<int>> parts;
-    if (max < 1 || size == 0 || ceil((2*max-size+1)/2.) * size < sum) return parts;
-
-    if (size == 1) {
-        if (1 <= sum && sum <= max) {
-            std::vector<int> single({sum});
-            parts.push_back(single);
+// Memo of digit combinations keyed by (sum, size, max digit)
+static std::unordered_map<unsigned long long, std::vector<unsigned long long>> combination_table;
+
+// All distinct combinations using digits in [1, max], largest digit first
+static const std::vector<unsigned long long> &combinations_up_to(int sum, int size, int max) {
+    unsigned long long key = ((unsigned long long)max << 42) 
+        | ((unsigned long long)size << 21) | (unsigned long long)sum;
+    auto found = combination_table.find(key);
+    if (found != combination_table.end()) {
+        return found->second;
+    }
+    std::vector<unsigned long long> parts;
+    // Out of digits, or the sum is out of reach of size distinct digits
+    if (max >= 1 && size > 0 && size <= max
+        && size * (2*max - size + 1) / 2 >= sum 
+        && size * (size + 1) / 2 <= sum) {
+        if (size == 1) {
+            parts.push_back(1ULL << (sum - 1));
+        } else {
+            // includes max, then everything without it
+            const std::vector<unsigned long long> &with_max = combinations_up_to(sum - max, size - 1, max - 1);
+            unsigned long long max_bit = 1ULL << (max - 1);
+            for (unsigned long long part : with_max) {
+                parts.push_back(part | max_bit);
+            }
+            const std::vector<unsigned long long> &without_max = combinations_up_to(sum, size, max - 1);
+            parts.insert(parts.end(), without_max.begin(), without_max.end());
         }
-        return parts;
-    } else {
-        std::vector<std::vector<int>> p0 = generatePartitions(sum-max, size-1, max-1); // includes max
-        std::vector<std::vector<int>> p1 = generatePartitions(sum, size, max-1);
+    }
+    // References into an unordered_map stay valid as it grows
+    return combination_table.emplace(key, parts).first->second;
+}
 
-        for (auto & p : p0) {
-            p.push_back(max);
-        }
-        p0.insert(p0.end(), p1.begin(), p1.end());
-        return p0;
+// Digit combinations of a cage as bitmasks (bit d is digit d + 1), memoized
+const std::vector<unsigned long long> &cage_combinations(int sum, int size, int n) {
+    assert(n <= 64);
+    return combinations_up_to(sum, size, n);
+}
+
+// Digits used by at least one combination of a cage
+unsigned long long cage_possible_digits(int sum, int size, int n) {
+    unsigned long long possible = 0;
+    for (unsigned long long part : cage_combinations(sum, size, n)) {
+        possible |= part;
     }
+    return possible;
 }
-// num of above
-int Cnf::generatePartitionsNum(int sum, int size, int max) {
-    if (max < 1 || size == 0 || ceil((2*max-size+1)/2.) * size < sum) return 0;
 
-    if (size == 1) {
-        if (1 <= sum && sum <= max) {
-            return 1;
-        }
+// Digits used by every combination of a cage
+unsigned long long cage_required_digits(int sum, int size, int n) {
+    const std::vector<unsigned long long> &parts = cage_combinations(sum, size, n);
+    if (parts.empty()) {
         return 0;
-    } else {
-        int p0 = generatePartitionsNum(sum-max, size-1, max-1); // includes max
-        int p1 = generatePartitionsNum(sum, size, max-1);
-        return p0+p1;
     }
+    unsigned long long required = ~0ULL;
+    for (unsigned long long part : parts) {
+        required &= part;
+    }
+    return required;
+}
+
+// Number of unit clauses the cage presolve adds
+int cage_presolve_clauses(int sum, int size, int n) {
+    unsigned long long all_digits = n == 64 ? ~0ULL : (1ULL << n) - 1;
+    unsigned long long impossible = all_digits & ~cage_possible_digits(sum, size, n);
+    return size * __builtin_popcountll(impossible) 
+        + __builtin_popcountll(cage_required_digits(sum, size, n));
 }
 
 // Convert sum constraints to sat
@@ -481,19 +811,14 @@ void Cnf::reduce_constraints(int n, int &var_id, int num_constraints, int** cons
             add_clause(dic, Cnf::clauses, Cnf::variables);
 
             // uniqueness of digits in a cage
-            for (int i = 0; i < size; i++) {
-                for (int j = i+1; j < size; j++) {
-                    Clause atmostone = make_small_clause(dic.literal_variable_ids[i], dic.literal_variable_ids[j], false, false);
-                    add_clause(atmostone, Cnf::clauses, Cnf::variables);
-                }
-            }
+            encode_group(Cnf::encodings[GROUP_CAGE], dic.literal_variable_ids, size, var_id, false);
         }
 
         // var for each partition
-        // generate every possible valid part
-        auto parts = generatePartitions(sum, size, n); // each partition's digits needs to be -1ed!
+        // every possible valid part comes from the combination table
+        const std::vector<unsigned long long> &parts = cage_combinations(sum, size, n);
         int first_part_var = var_id;
-        for (auto & p : parts) {
+        for (unsigned long long part_digits : parts) {
             int part_var = var_id;
             var_id++;
             VariableLocations part_variable;
@@ -507,16 +832,17 @@ void Cnf::reduce_constraints(int n, int &var_id, int num_constraints, int** cons
             part.num_literals = size+1;
             part.literal_variable_ids = (int *)malloc(sizeof(int) * (size+1));
             part.literal_signs = (bool *)malloc(sizeof(bool) * (size+1));
-            for (int cell = 0; cell < size; cell++) {
-                int row = data[2*cell];
-                int col = data[2*cell+1];
-                part.literal_variable_ids[cell] = digit_in_cage_vars[p[cell]-1];
+            int cell = 0;
+            for (int d = 0; d < n; d++) {
+                if (!((part_digits >> d) & 1)) continue;
+                part.literal_variable_ids[cell] = digit_in_cage_vars[d];
                 part.literal_signs[cell] = false;
 
-                Clause part2 = make_small_clause(digit_in_cage_vars[p[cell]-1], part_var, true, false);
+                Clause part2 = make_small_clause(digit_in_cage_vars[d], part_var, true, false);
                 add_clause(part2, Cnf::clauses, Cnf::variables);
+                cell++;
             }
-            std::sort(part.literal_variable_ids, part.literal_variable_ids + size);
+            assert(cell == size);
             part.literal_variable_ids[size] = part_var;
             part.literal_signs[size] = true;
             add_clause(part, Cnf::clauses, Cnf::variables);
@@ -532,6 +858,25 @@ void Cnf::reduce_constraints(int n, int &var_id, int num_constraints, int** cons
             allparts.literal_signs[i] = true;
         }
         add_clause(allparts, Cnf::clauses, Cnf::variables);
+
+        // Presolve: no cell holds a digit that fits no combination, and
+        // digits in every combination are in the cage
+        if (!CAGE_PRESOLVE) continue;
+        unsigned long long possible = cage_possible_digits(sum, size, n);
+        unsigned long long required = cage_required_digits(sum, size, n);
+        for (int d = 0; d < n; d++) {
+            if (!((possible >> d) & 1)) {
+                for (int cell = 0; cell < size; cell++) {
+                    int cell_var = getRegularVariable(data[2+2*cell], data[2+2*cell+1], d, n);
+                    bool sign = false;
+                    encode_clause(&cell_var, &sign, 1);
+                }
+            }
+            if ((required >> d) & 1) {
+                bool sign = true;
+                encode_clause(&digit_in_cage_vars[d], &sign, 1);
+            }
+        }
     }
 }
 
@@ -678,6 +1023,101 @@ void Cnf::reduce_puzzle_original(
     }
 }
 
+// Reduction with a selectable encoding per group type
+int Cnf::reduce_puzzle_encoded(
+        int n, 
+        int sqrt_n, 
+        int num_assignments,
+        GridAssignment *assignments,
+        int numExtraVars, 
+        int numExtraClauses) 
+    {
+    int n_squ = n * n;
+    Cnf::num_variables = (n * n_squ) + numExtraVars;
+    // Exact figure, every group type has n^2 groups of n variables
+    int num_clauses = num_assignments + numExtraClauses;
+    for (int group_type = GROUP_CELL; group_type <= GROUP_BOX; group_type++) {
+        int group_vars;
+        int group_clauses;
+        encoding_size(Cnf::encodings[group_type], n, true, &group_vars, &group_clauses);
+        Cnf::num_variables += n_squ * group_vars;
+        num_clauses += n_squ * group_clauses;
+    }
+    Cnf::true_assignment_statuses = (char *)calloc(
+        sizeof(char), Cnf::num_variables);
+    Cnf::false_assignment_statuses = (char *)calloc(
+        sizeof(char), Cnf::num_variables);
+    Clauses clauses(num_clauses, Cnf::num_conflict_to_hold);
+    Cnf::clauses = clauses;
+    Cnf::variables = (VariableLocations *)malloc(
+        sizeof(VariableLocations) * Cnf::num_variables);
+    int variable_id = 0;
+    for (int k = 0; k < n; k++) {
+        for (int row = 0; row < n; row++) {
+            for (int col = 0; col < n; col++) {
+                VariableLocations current_variable;
+                current_variable.clauses_containing = new std::vector<int>();
+                current_variable.variable_id = variable_id;
+                current_variable.variable_row = row;
+                current_variable.variable_col = col;
+                current_variable.variable_k = k;
+                Cnf::true_assignment_statuses[variable_id] = 'u';
+                Cnf::false_assignment_statuses[variable_id] = 'u';
+                Cnf::variables[variable_id] = current_variable;
+                variable_id++;
+            }
+        }
+    }
+    int vars[n];
+    // Each cell has exactly one digit
+    for (int row = 0; row < n; row++) {
+        for (int col = 0; col < n; col++) {
+            for (int k = 0; k < n; k++) {
+                vars[k] = getRegularVariable(row, col, k, n);
+            }
+            encode_group(Cnf::encodings[GROUP_CELL], vars, n, variable_id, true);
+        }
+    }
+    // Each row has exactly one of each digit
+    for (int k = 0; k < n; k++) {
+        for (int row = 0; row < n; row++) {
+            for (int col = 0; col < n; col++) {
+                vars[col] = getRegularVariable(row, col, k, n);
+            }
+            encode_group(Cnf::encodings[GROUP_ROW], vars, n, variable_id, true);
+        }
+    }
+    // Each col has exactly one of each digit
+    for (int k = 0; k < n; k++) {
+        for (int col = 0; col < n; col++) {
+            for (int row = 0; row < n; row++) {
+                vars[row] = getRegularVariable(row, col, k, n);
+            }
+            encode_group(Cnf::encodings[GROUP_COL], vars, n, variable_id, true);
+        }
+    }
+    // Each chunk has exactly one of each digit
+    for (int k = 0; k < n; k++) {
+        for (int block_row = 0; block_row < sqrt_n; block_row++) {
+            for (int block_col = 0; block_col < sqrt_n; block_col++) {
+                for (int local = 0; local < n; local++) {
+                    int row = (block_row * sqrt_n) + (local / sqrt_n);
+                    int col = (block_col * sqrt_n) + (local % sqrt_n);
+                    vars[local] = getRegularVariable(row, col, k, n);
+                }
+                encode_group(Cnf::encodings[GROUP_BOX], vars, n, variable_id, true);
+            }
+        }
+    }
+
+    for (int i = 0; i < num_assignments; i++) {
+        int given = getRegularVariable(assignments[i].row, assignments[i].col, assignments[i].value, n);
+        bool sign = true;
+        encode_clause(&given, &sign, 1);
+    }
+    return variable_id;
+}
+
 // Initializes CNF compression
 void Cnf::init_compression() {
     Cnf::ints_needed_for_clauses = ceil_div(
@@ -687,7 +1127,7 @@ void Cnf::init_compression() {
     Cnf::ints_needed_for_vars = ceil_div(
         Cnf::num_variables, (sizeof(int) * 8));
     int ints_per_state = (2 * Cnf::ints_needed_for_vars) + Cnf::ints_needed_for_clauses;
-    Cnf::work_ints = 3 + ints_per_state;
+    Cnf::work_ints = WORK_TRAILER_INTS + ints_per_state;
     int start_clause_id = 0;
     for (int comp_index = 0; comp_index < Cnf::ints_needed_for_clauses; comp_index++) {
         unsigned int running_addition = 1;
@@ -1002,10 +1442,14 @@ void Cnf::add_to_edit_stack(void *raw_edit) {
     FormulaEdit edit = *((FormulaEdit *)raw_edit);
     (*((Deque *)(Cnf::edit_stack.peak_front()))).add_to_front(raw_edit);
 
+    LevelChanges *changes = (LevelChanges *)(Cnf::level_changes.peak_front());
     if (edit.edit_type == 'v') {
         // save ptr to [sub]-edit stack for fast conflict clause adding
         Deque *subedit_ptr = (Deque *)(Cnf::edit_stack.peak_front());
         Cnf::variables[edit.edit_id].edit_stack_ptr = subedit_ptr;
+        changes->variables.push_back(edit.edit_id);
+    } else if (edit.edit_type == 'c' && edit.edit_id < Cnf::clauses.max_indexable) {
+        changes->dropped_clauses.push_back(edit.edit_id);
     }
 }
 
@@ -1470,6 +1914,7 @@ void Cnf::undo_local_edits() {
     void *local_edits_ptr = Cnf::edit_stack.pop_from_front();
     Deque local_edits = (*((Deque *)local_edits_ptr));
     free(local_edits_ptr);
+    delete (LevelChanges *)(Cnf::level_changes.pop_from_front());
     while (local_edits.count > 0) {
         FormulaEdit *recent_ptr = (FormulaEdit *)((local_edits).pop_from_front());
         FormulaEdit recent = *recent_ptr;
@@ -1543,16 +1988,53 @@ void Cnf::recurse() {
     Deque *first_edit_group_ptr = (Deque *)malloc(sizeof(Deque));
     *first_edit_group_ptr = first_edit_group;
     Cnf::edit_stack.add_to_front(first_edit_group_ptr);
+    Cnf::level_changes.add_to_front(new LevelChanges());
     Cnf::depth++;
     if (PRINT_INDENT) {
         Cnf::depth_str.append(" ");
     }
 }
 
+// Drops the oldest edit group, adding its changes to the oldest compressed state
+void Cnf::prune_oldest_edit_group() {
+    assert(Cnf::edit_stack.count > 0);
+    assert(Cnf::level_changes.count == Cnf::edit_stack.count);
+    Cnf::retired_edit_groups.add_to_back(Cnf::edit_stack.pop_from_back());
+    LevelChanges *changes = (LevelChanges *)(Cnf::level_changes.pop_from_back());
+    unsigned int *compressed = Cnf::oldest_compressed;
+    for (int var_id : changes->variables) {
+        VariableLocations location = Cnf::variables[var_id];
+        if (Cnf::assigned_true[var_id]) {
+            compressed[location.variable_true_addition_index] |= location.variable_addition;
+        } else {
+            assert(Cnf::assigned_false[var_id]);
+            compressed[location.variable_false_addition_index] |= location.variable_addition;
+        }
+        Cnf::assignment_times[var_id] = -1; // IMPORTANT
+        Cnf::assignment_depths[var_id] = -1;
+        add_to_cube(var_id);
+    }
+    for (int clause_id : changes->dropped_clauses) {
+        Clause clause = Cnf::clauses.get_clause(clause_id);
+        compressed[clause.clause_addition_index] |= clause.clause_addition;
+    }
+    delete changes;
+}
+
+// Frees edit groups dropped by prune_oldest_edit_group
+void Cnf::free_retired_edit_groups() {
+    while (Cnf::retired_edit_groups.count > 0) {
+        Deque *edit_group_ptr = (Deque *)(Cnf::retired_edit_groups.pop_from_front());
+        Deque edit_group = *edit_group_ptr;
+        free(edit_group_ptr);
+        edit_group.free_deque();
+    }
+}
+
 // Returns the task embedded in the work received
-Task Cnf::extract_task_from_work(void *work) {
+Task Cnf::extract_task_from_work(void *work, int num_ints) {
     Task task;
-    int offset = Cnf::ints_needed_for_clauses + (2 * Cnf::ints_needed_for_vars);
+    int offset = num_ints - WORK_TRAILER_INTS;
     task.var_id = ((unsigned int *)work)[offset];
     task.assignment = (bool)(((unsigned int *)work)[offset + 1]);
     task.implier = (int)(((unsigned int *)work)[offset + 2]);
@@ -1560,10 +2042,93 @@ Task Cnf::extract_task_from_work(void *work) {
     return task;
 }
 
+// Returns copies of the conflict clauses bundled with the work received
+std::vector<Clause> Cnf::extract_clauses_from_work(void *work, int num_ints) {
+    int bundle_ints = ((int *)work)[num_ints - 2];
+    int *bundle = (int *)work + num_ints - WORK_TRAILER_INTS - bundle_ints;
+    std::vector<Clause> bundled_clauses;
+    int position = 0;
+    while (position < bundle_ints) {
+        Clause clause;
+        clause.num_literals = bundle[position++];
+        clause.literal_signs = (bool *)malloc(sizeof(bool) * clause.num_literals);
+        clause.literal_variable_ids = (int *)malloc(sizeof(int) * clause.num_literals);
+        for (int i = 0; i < clause.num_literals; i++) {
+            int literal = bundle[position++];
+            clause.literal_signs[i] = literal > 0;
+            clause.literal_variable_ids[i] = (literal > 0 ? literal : -literal) - 1;
+        }
+        bundled_clauses.push_back(clause);
+    }
+    assert(position == bundle_ints);
+    return bundled_clauses;
+}
+
+// Collects the shortest conflict clauses a compressed state leaves
+// open, as a length followed by literals for each
+void Cnf::bundle_conflict_clauses(unsigned int *compressed, std::vector<int> &bundle) {
+    unsigned int *compressed_true = compressed + Cnf::ints_needed_for_clauses;
+    unsigned int *compressed_false = compressed_true + Cnf::ints_needed_for_vars;
+    // Unassigned literals and id of each candidate
+    std::vector<std::pair<int, int>> candidates;
+    for (int i = 0; i < Cnf::clauses.num_conflict_indexed; i++) {
+        int clause_id = Cnf::clauses.max_indexable + i;
+        Clause clause = Cnf::clauses.get_clause(clause_id);
+        // Only clauses short enough to broadcast, which bounds work messages
+        if (clause.num_literals >= SEND_CONFLICT_CLAUSE_LIMIT * Cnf::n) {
+            continue;
+        }
+        bool satisfied = false;
+        int num_unassigned = 0;
+        for (int lit = 0; lit < clause.num_literals && !satisfied; lit++) {
+            int var_id = clause.literal_variable_ids[lit];
+            bool is_true = (compressed_true[var_id / 32] >> (var_id % 32)) & 1;
+            bool is_false = (compressed_false[var_id / 32] >> (var_id % 32)) & 1;
+            satisfied = clause.literal_signs[lit] ? is_true : is_false;
+            num_unassigned += !is_true && !is_false;
+        }
+        // Thieves would drop long clauses straight away
+        if (satisfied || num_unassigned == 0 
+            || num_unassigned > CONFLICT_CLAUSE_UNSAT_LIMIT * Cnf::n) {
+            continue;
+        }
+        candidates.push_back({num_unassigned, clause_id});
+    }
+    int num_bundled = std::min((int)candidates.size(), WORK_BUNDLE_CLAUSES);
+    std::partial_sort(candidates.begin(), candidates.begin() + num_bundled, candidates.end());
+    for (int i = 0; i < num_bundled; i++) {
+        Clause clause = Cnf::clauses.get_clause(candidates[i].second);
+        bundle.push_back(clause.num_literals);
+        for (int lit = 0; lit < clause.num_literals; lit++) {
+            int var_id = clause.literal_variable_ids[lit];
+            bundle.push_back(clause.literal_signs[lit] ? var_id + 1 : -(var_id + 1));
+        }
+    }
+}
+
 // Reconstructs one's own formula (state) from an integer representation
-void Cnf::reconstruct_state(void *work, Deque &task_stack) {
-    Cnf::clauses.reset();
+bool Cnf::reconstruct_state(void *work, int num_ints, Deque &task_stack) {
     unsigned int *compressed = (unsigned int *)work;
+    if (compressed[num_ints - 1] == WORK_FORMAT_CUBE) {
+        int num_literals = num_ints - WORK_TRAILER_INTS - compressed[num_ints - 2];
+        Cnf::oldest_cube.assign((int *)work, (int *)work + num_literals);
+        Cnf::cube_known = true;
+        compressed = cube_to_compressed(Cnf::oldest_cube.data(), num_literals);
+    } else {
+        if (compressed[num_ints - 1] == WORK_FORMAT_PACKED) {
+            compressed = unpack_compressed((unsigned char *)work);
+        }
+        Cnf::oldest_cube.clear();
+        Cnf::cube_known = false;
+    }
+    // Must run before the assignment is overwritten below
+    std::vector<int> changed_clauses;
+    bool incremental = INCREMENTAL_RECONSTRUCT 
+        && find_changed_clauses(compressed, changed_clauses);
+    Cnf::last_reconstruct_incremental = incremental;
+    if (!incremental) {
+        Cnf::clauses.reset();
+    }
     free(Cnf::oldest_compressed);
     Cnf::oldest_compressed = compressed;
     if (PRINT_LEVEL > 5) print_compressed(
@@ -1575,40 +2140,37 @@ void Cnf::reconstruct_state(void *work, Deque &task_stack) {
     // Set values
     memset(Cnf::true_assignment_statuses, 'u', Cnf::num_variables * sizeof(char));
     memset(Cnf::false_assignment_statuses, 'u', Cnf::num_variables * sizeof(char));
-    int value_group_offset = 0;
+    unsigned int *compressed_true = compressed + Cnf::ints_needed_for_clauses;
+    unsigned int *compressed_false = compressed_true + Cnf::ints_needed_for_vars;
+    unpack_bits(compressed_true, Cnf::assigned_true, Cnf::ints_needed_for_vars);
+    unpack_bits(compressed_false, Cnf::assigned_false, Cnf::ints_needed_for_vars);
+    // Only assigned variables need their statuses changed
+    Cnf::num_vars_assigned = 0;
     for (int value_group = 0; value_group < Cnf::ints_needed_for_vars; value_group++) {
-        unsigned int compressed_group_true = compressed[
-            Cnf::ints_needed_for_clauses + value_group];
-        unsigned int compressed_group_false = compressed[
-            Cnf::ints_needed_for_clauses + Cnf::ints_needed_for_vars + value_group];
-        bool *value_bits_true = int_to_bits(compressed_group_true);
-        bool *value_bits_false = int_to_bits(compressed_group_false);
-        memcpy(Cnf::assigned_true + value_group_offset, value_bits_true, 32);
-        memcpy(Cnf::assigned_false + value_group_offset, value_bits_false, 32);
-        Cnf::num_vars_assigned = 0;
-        for (unsigned int var_id = 0; var_id < Cnf::num_variables; var_id++) {
-            if (Cnf::assigned_true[var_id]) {
-                Cnf::true_assignment_statuses[var_id] = 'r';
-                Cnf::false_assignment_statuses[var_id] = 'u';
-                Cnf::num_vars_assigned++;
-            } else if (Cnf::assigned_false[var_id]) {
-                Cnf::true_assignment_statuses[var_id] = 'u';
-                Cnf::false_assignment_statuses[var_id] = 'r';
-                Cnf::num_vars_assigned++;
-            } else {
-                Cnf::true_assignment_statuses[var_id] = 'u';
-                Cnf::false_assignment_statuses[var_id] = 'u';
-            }
+        unsigned int true_bits = compressed_true[value_group];
+        unsigned int false_bits = compressed_false[value_group] & ~true_bits;
+        Cnf::num_vars_assigned += __builtin_popcount(true_bits) + __builtin_popcount(false_bits);
+        while (true_bits != 0) {
+            int var_id = 32 * value_group + __builtin_ctz(true_bits);
+            assert(var_id < Cnf::num_variables);
+            Cnf::true_assignment_statuses[var_id] = 'r';
+            true_bits &= true_bits - 1;
+        }
+        while (false_bits != 0) {
+            int var_id = 32 * value_group + __builtin_ctz(false_bits);
+            assert(var_id < Cnf::num_variables);
+            Cnf::false_assignment_statuses[var_id] = 'r';
+            false_bits &= false_bits - 1;
         }
-        free(value_bits_true);
-        free(value_bits_false);
-        value_group_offset += 32;
     }
 
     // Re-evaluate conflict clauses
     int ctr = 0;
     for (int i = 0; i < Cnf::clauses.num_conflict_indexed; i++) {
         int conflict_id = Cnf::clauses.max_indexable + i;
+        if (incremental && Cnf::clauses.clause_is_dropped(conflict_id)) {
+            Cnf::clauses.re_add_clause(conflict_id);
+        }
         Clause conflict_clause = Cnf::clauses.get_clause(conflict_id);
         int num_unsat;
         char clause_status = check_clause(conflict_clause, &num_unsat);
@@ -1619,7 +2181,7 @@ void Cnf::reconstruct_state(void *work, Deque &task_stack) {
             Cnf::clauses.drop_clause(conflict_id);
             Cnf::clauses.num_unsats[conflict_id] = -1;
         } else {
-            if (num_unsat != conflict_clause.num_literals) {
+            if (num_unsat != Cnf::clauses.conflict_clauses.element_counts[i]) {
                 assert(num_unsat > 0);
                 Cnf::clauses.change_clause_size(conflict_id, num_unsat);
             }
@@ -1627,33 +2189,27 @@ void Cnf::reconstruct_state(void *work, Deque &task_stack) {
         }
     }
 
-    int clause_group_offset = 0;
-    // Drop normal clauses
-    for (int clause_group = 0; clause_group < Cnf::ints_needed_for_clauses; clause_group++) {
-        unsigned int compressed_group = compressed[clause_group];
-        bool *clause_bits = int_to_bits(compressed_group);
-        for (int bit = 0; bit < 32; bit++) {
-            int clause_id = bit + clause_group_offset;
-            if (clause_id >= Cnf::clauses.num_indexed) break;
-            assert(!Cnf::clauses.clause_is_dropped(clause_id));
-            bool should_be_dropped = clause_bits[bit];
-            if (should_be_dropped) {
-                Cnf::clauses.drop_clause(clause_id);
-                Cnf::clauses.num_unsats[clause_id] = -1; // to be determined while in the alg
-            } else {
-                Clause clause = Cnf::clauses.get_clause(clause_id);
-                int num_unsat;
-                char clause_status = check_clause(clause, &num_unsat);
-                assert(num_unsat > 0);
-                if (num_unsat != clause.num_literals) {
-                    Cnf::clauses.change_clause_size(clause_id, num_unsat);
-                }
-                Cnf::clauses.num_unsats[clause_id] = num_unsat;
+    if (incremental) {
+        // Everything else already agrees with the new state
+        for (int clause_id : changed_clauses) {
+            bool should_be_dropped = (compressed[clause_id / 32] >> (clause_id % 32)) & 1;
+            reconstruct_clause(clause_id, should_be_dropped);
+        }
+    } else {
+        int clause_group_offset = 0;
+        // Drop normal clauses
+        for (int clause_group = 0; clause_group < Cnf::ints_needed_for_clauses; clause_group++) {
+            unsigned int compressed_group = compressed[clause_group];
+            for (int bit = 0; bit < 32; bit++) {
+                int clause_id = bit + clause_group_offset;
+                if (clause_id >= Cnf::clauses.num_indexed) break;
+                assert(!Cnf::clauses.clause_is_dropped(clause_id));
+                reconstruct_clause(clause_id, (compressed_group >> bit) & 1);
             }
+            clause_group_offset += 32;
         }
-        free(clause_bits);
-        clause_group_offset += 32;
     }
+    assert(state_matches_compressed(compressed));
 
     memset(Cnf::assignment_times, -1, Cnf::num_variables * sizeof(int));
     memset(Cnf::assignment_depths, -1, Cnf::num_variables * sizeof(int));
@@ -1663,50 +2219,219 @@ void Cnf::reconstruct_state(void *work, Deque &task_stack) {
         Deque local_edit_group = *local_edit_group_ptr;
         free(local_edit_group_ptr);
         local_edit_group.free_deque();
+        delete (LevelChanges *)(Cnf::level_changes.pop_from_front());
     }
+    free_retired_edit_groups();
     Cnf::depth = 0;
     Cnf::depth_str = "";
     Cnf::current_time = 0;
-    return; // Cnf and task stack are now ready for a new call to solve
+    return compressed == work; // Cnf and task stack are now ready for a new call to solve
+}
+
+// Adds an assigned variable to the oldest cube, unless unit
+// propagation over the normal clauses rederives it
+void Cnf::add_to_cube(int var_id) {
+    if (!Cnf::cube_known) {
+        return;
+    }
+    int implier = Cnf::variables[var_id].implying_clause_id;
+    if (0 <= implier && implier < Cnf::clauses.max_indexable) {
+        return;
+    }
+    assert(Cnf::assigned_true[var_id] || Cnf::assigned_false[var_id]);
+    Cnf::oldest_cube.push_back(Cnf::assigned_true[var_id] ? var_id + 1 : -(var_id + 1));
+}
+
+// Makes the compressed state that assigns just the literals of a cube
+unsigned int *Cnf::cube_to_compressed(int *cube, int num_literals) {
+    unsigned int *compressed = (unsigned int *)calloc(
+        sizeof(unsigned int), Cnf::work_ints);
+    unsigned int *compressed_true = compressed + Cnf::ints_needed_for_clauses;
+    unsigned int *compressed_false = compressed_true + Cnf::ints_needed_for_vars;
+    for (int i = 0; i < num_literals; i++) {
+        bool value = cube[i] > 0;
+        int var_id = (value ? cube[i] : -cube[i]) - 1;
+        assert(0 <= var_id && var_id < Cnf::num_variables);
+        unsigned int *compressed_values = value ? compressed_true : compressed_false;
+        compressed_values[var_id / 32] |= 1u << (var_id % 32);
+        // Drop the normal clauses the literal satisfies
+        for (int pm_id : *(Cnf::variables[var_id].clauses_containing)) {
+            int clause_id = pm_id < 0 ? -(pm_id + 1) : pm_id;
+            if ((pm_id >= 0) == value && clause_id < Cnf::clauses.max_indexable) {
+                compressed[clause_id / 32] |= 1u << (clause_id % 32);
+            }
+        }
+    }
+    return compressed;
+}
+
+// Encodes the sections of a compressed state, returns the bytes written
+int Cnf::pack_compressed(unsigned int *compressed, unsigned char *packed) {
+    unsigned int *compressed_true = compressed + Cnf::ints_needed_for_clauses;
+    unsigned int *compressed_false = compressed_true + Cnf::ints_needed_for_vars;
+    unsigned char *packed_end = packed;
+    packed_end += encode_bitset(compressed, Cnf::clauses.num_indexed, packed_end);
+    packed_end += encode_bitset(compressed_true, Cnf::num_variables, packed_end);
+    packed_end += encode_bitset(compressed_false, Cnf::num_variables, packed_end);
+    return packed_end - packed;
+}
+
+// Decodes packed sections into a new compressed state
+unsigned int *Cnf::unpack_compressed(unsigned char *packed) {
+    unsigned int *compressed = (unsigned int *)calloc(
+        sizeof(unsigned int), Cnf::work_ints);
+    unsigned int *compressed_true = compressed + Cnf::ints_needed_for_clauses;
+    unsigned int *compressed_false = compressed_true + Cnf::ints_needed_for_vars;
+    packed += decode_bitset(packed, compressed, Cnf::clauses.num_indexed);
+    packed += decode_bitset(packed, compressed_true, Cnf::num_variables);
+    decode_bitset(packed, compressed_false, Cnf::num_variables);
+    return compressed;
+}
+
+// Collects the normal clauses a compressed state changes relative to
+// the current one. Returns false when a full reconstruct is cheaper.
+bool Cnf::find_changed_clauses(unsigned int *compressed, std::vector<int> &changed_clauses) {
+    unsigned int *compressed_true = compressed + Cnf::ints_needed_for_clauses;
+    unsigned int *compressed_false = compressed_true + Cnf::ints_needed_for_vars;
+    // Occurrences touched are the incremental cost, a full pass is about one per clause
+    int occurrences_touched = 0;
+    for (int value_group = 0; value_group < Cnf::ints_needed_for_vars; value_group++) {
+        unsigned int changed_bits = 
+            (bits_to_int(Cnf::assigned_true + 32 * value_group) ^ compressed_true[value_group])
+            | (bits_to_int(Cnf::assigned_false + 32 * value_group) ^ compressed_false[value_group]);
+        while (changed_bits != 0) {
+            int var_id = 32 * value_group + __builtin_ctz(changed_bits);
+            changed_bits &= changed_bits - 1;
+            std::vector<int> *clauses_containing = Cnf::variables[var_id].clauses_containing;
+            occurrences_touched += clauses_containing->size();
+            if (occurrences_touched > Cnf::clauses.num_indexed) {
+                return false;
+            }
+            for (int pm_id : *clauses_containing) {
+                int clause_id = pm_id < 0 ? -(pm_id + 1) : pm_id;
+                // Conflict clauses are always re-evaluated
+                if (clause_id < Cnf::clauses.max_indexable) {
+                    changed_clauses.push_back(clause_id);
+                }
+            }
+        }
+    }
+    bool *dropped = Cnf::clauses.normal_clauses.elements_dropped;
+    for (int clause_group = 0; clause_group < Cnf::ints_needed_for_clauses; clause_group++) {
+        unsigned int changed_bits = bits_to_int(dropped + 32 * clause_group) ^ compressed[clause_group];
+        while (changed_bits != 0) {
+            changed_clauses.push_back(32 * clause_group + __builtin_ctz(changed_bits));
+            changed_bits &= changed_bits - 1;
+        }
+    }
+    std::sort(changed_clauses.begin(), changed_clauses.end());
+    changed_clauses.erase(
+        std::unique(changed_clauses.begin(), changed_clauses.end()), 
+        changed_clauses.end());
+    return true;
+}
+
+// Sets one normal clause's drop and size from the current assignment
+void Cnf::reconstruct_clause(int clause_id, bool should_be_dropped) {
+    bool is_dropped = Cnf::clauses.clause_is_dropped(clause_id);
+    if (should_be_dropped) {
+        if (!is_dropped) {
+            Cnf::clauses.drop_clause(clause_id);
+        }
+        Cnf::clauses.num_unsats[clause_id] = -1; // to be determined while in the alg
+        return;
+    }
+    if (is_dropped) {
+        Cnf::clauses.re_add_clause(clause_id);
+    }
+    Clause clause = Cnf::clauses.get_clause(clause_id);
+    int num_unsat;
+    char clause_status = check_clause(clause, &num_unsat);
+    assert(num_unsat > 0);
+    if (num_unsat != Cnf::clauses.normal_clauses.element_counts[clause_id]) {
+        Cnf::clauses.change_clause_size(clause_id, num_unsat);
+    }
+    Cnf::clauses.num_unsats[clause_id] = num_unsat;
+}
+
+// Testing method only, whether the formula matches a compressed state
+bool Cnf::state_matches_compressed(unsigned int *compressed) {
+    int num_listed = 0;
+    for (int clause_id = 0; clause_id < Cnf::clauses.num_indexed; clause_id++) {
+        bool should_be_dropped = (compressed[clause_id / 32] >> (clause_id % 32)) & 1;
+        if (Cnf::clauses.clause_is_dropped(clause_id) != should_be_dropped) {
+            return false;
+        }
+        if (should_be_dropped) {
+            continue;
+        }
+        num_listed++;
+        int num_unsat;
+        check_clause(Cnf::clauses.get_clause(clause_id), &num_unsat);
+        if (Cnf::clauses.num_unsats[clause_id] != num_unsat 
+            || Cnf::clauses.normal_clauses.element_counts[clause_id] != num_unsat) {
+            return false;
+        }
+    }
+    return num_listed == Cnf::clauses.normal_clauses.linked_list_count;
 }
 
 // Converts task + state into work message, returns a COPY of the data
-void *Cnf::convert_to_work_message(unsigned int *compressed, Task task) {
-    assert(task.var_id >= 0);
-    unsigned int *work = (unsigned int *)malloc(sizeof(unsigned int) * work_ints);
-    memcpy(work, compressed, sizeof(unsigned int) * work_ints);
-    int offset = Cnf::ints_needed_for_clauses + (2 * Cnf::ints_needed_for_vars);
+void *Cnf::convert_to_work_message(unsigned int *compressed, Task task, int *num_ints) {
     assert(task.var_id >= 0);
+    std::vector<int> bundle;
+    bundle_conflict_clauses(compressed, bundle);
+    // Packing adds a byte per section, so leave room for one more int
+    unsigned int *work = (unsigned int *)calloc(
+        sizeof(unsigned int), Cnf::work_ints + 1 + bundle.size());
+    int offset = Cnf::work_ints - WORK_TRAILER_INTS;
+    unsigned int format = WORK_FORMAT_BITMAP;
+    if (PACKED_WORK_MESSAGES) {
+        offset = ceil_div(pack_compressed(compressed, (unsigned char *)work), sizeof(unsigned int));
+        format = WORK_FORMAT_PACKED;
+    } else {
+        memcpy(work, compressed, sizeof(unsigned int) * offset);
+    }
+    // The thief replays a cube, so it pays off whenever it is smaller
+    if (CUBE_WORK_MESSAGES && Cnf::cube_known && (int)Cnf::oldest_cube.size() < offset) {
+        offset = Cnf::oldest_cube.size();
+        memcpy(work, Cnf::oldest_cube.data(), sizeof(int) * offset);
+        format = WORK_FORMAT_CUBE;
+    }
+    memcpy(work + offset, bundle.data(), sizeof(int) * bundle.size());
+    offset += bundle.size();
+    *num_ints = offset + WORK_TRAILER_INTS;
     work[offset] = ((unsigned int)task.var_id);
     work[offset + 1] = (unsigned int)task.assignment;
     work[offset + 2] = (unsigned int)task.implier;
+    work[offset + 3] = bundle.size();
+    work[offset + 4] = format;
     return (void *)work;
 }
 
+// Returns the size of the largest message a rank can be sent
+int Cnf::max_message_bytes() {
+    // Packing may round up by an int, bundled clauses are each a length
+    // and fewer than SEND_CONFLICT_CLAUSE_LIMIT * n literals
+    int clause_ints = (int)(SEND_CONFLICT_CLAUSE_LIMIT * Cnf::n);
+    int work_bytes = sizeof(unsigned int) 
+        * (Cnf::work_ints + 1 + WORK_BUNDLE_CLAUSES * clause_ints);
+    // A clause batch only passes its limit when one clause alone does
+    int clause_bytes = sizeof(int) * std::max(CLAUSE_BATCH_INTS, clause_ints + 1);
+    return std::max(work_bytes, clause_bytes);
+}
+
 // Converts current formula to integer representation
 unsigned int *Cnf::to_int_rep() {
     unsigned int *compressed = (unsigned *)calloc(
         sizeof(unsigned int), work_ints);
-    bool *bit_addr = Cnf::clauses.normal_clauses.elements_dropped;
-    for (int i = 0; i < Cnf::ints_needed_for_clauses; i++) {
-        unsigned int current = bits_to_int(bit_addr);
-        compressed[i] = current;
-        bit_addr = bit_addr + 32;
-    }
-    bit_addr = Cnf::assigned_true;
-    for (int i = 0; i < Cnf::ints_needed_for_vars; i++) {
-        unsigned int current = bits_to_int(bit_addr);
-        compressed[i + Cnf::ints_needed_for_clauses] = current;
-        bit_addr = bit_addr + 32;
-    }
-    bit_addr = Cnf::assigned_false;
-    for (int i = 0; i < Cnf::ints_needed_for_vars; i++) {
-        unsigned int current = bits_to_int(bit_addr);
-        compressed[
-            i + Cnf::ints_needed_for_clauses + Cnf::ints_needed_for_vars
-            ] = current;
-        bit_addr = bit_addr + 32;
-    }
+    pack_bits(Cnf::clauses.normal_clauses.elements_dropped, 
+        compressed, Cnf::ints_needed_for_clauses);
+    pack_bits(Cnf::assigned_true, 
+        compressed + Cnf::ints_needed_for_clauses, Cnf::ints_needed_for_vars);
+    pack_bits(Cnf::assigned_false, 
+        compressed + Cnf::ints_needed_for_clauses + Cnf::ints_needed_for_vars, 
+        Cnf::ints_needed_for_vars);
     return compressed;
 }
 
@@ -1723,8 +2448,12 @@ void Cnf::free_cnf() {
         Deque local_edit_group = *local_edit_group_ptr;
         free(local_edit_group_ptr);
         local_edit_group.free_deque();
+        delete (LevelChanges *)(Cnf::level_changes.pop_from_front());
     }
+    free_retired_edit_groups();
     Cnf::edit_stack.free_deque();
+    Cnf::level_changes.free_deque();
+    Cnf::retired_edit_groups.free_deque();
     free(Cnf::oldest_compressed);
     free(Cnf::assigned_true);
     free(Cnf::assigned_false);
@@ -22,6 +22,13 @@ struct VariableLocations {
     int variable_k;
 };
 
+// Variables assigned and normal clauses dropped by one edit group, so the
+// oldest compressed state can skip past the group without replaying it
+struct LevelChanges {
+    std::vector<int> variables;
+    std::vector<int> dropped_clauses;
+};
+
 int getRegularVariable(int i, int j, int k, int n);
 
 int getSubcolID(
@@ -37,11 +44,106 @@ int comm_num_clauses(int n);
 
 int comm_num_vars(int n, bool begin=true);
 
+// Digit combinations of a cage as bitmasks (bit d is digit d + 1), memoized
+const std::vector<unsigned long long> &cage_combinations(int sum, int size, int n);
+
+// Digits used by at least one combination of a cage
+unsigned long long cage_possible_digits(int sum, int size, int n);
+
+// Digits used by every combination of a cage
+unsigned long long cage_required_digits(int sum, int size, int n);
+
+// Number of unit clauses the cage presolve adds
+int cage_presolve_clauses(int sum, int size, int n);
+
+// At-most-one encodings that can be selected per group type (see -e)
+#define ENCODING_PAIRWISE 0
+#define ENCODING_COMMANDER 1
+#define ENCODING_SEQUENTIAL 2
+#define ENCODING_PRODUCT 3
+#define ENCODING_BIMANDER 4
+#define ENCODING_LADDER 5
+#define NUM_ENCODINGS 6
+// Lets the reduction pick its benchmarked default
+#define ENCODING_DEFAULT -1
+
+// Group types an encoding can be selected for
+#define GROUP_CELL 0
+#define GROUP_ROW 1
+#define GROUP_COL 2
+#define GROUP_BOX 3
+#define GROUP_CAGE 4
+#define NUM_GROUP_TYPES 5
+
+// Leads a flat formula image, followed by clause sizes, literal ids,
+// literal signs (packed bytes), variable cells and occurrence lists
+struct FormulaImageHeader {
+    int magic;
+    int version;
+    int n;
+    int num_variables;
+    int num_clauses;
+    int num_conflict_to_hold;
+    int reduction_method;
+    int encodings[NUM_GROUP_TYPES];
+    int num_literals;
+    int num_occurrences;
+};
+
+#define FORMULA_IMAGE_MAGIC 0x534b434e
+#define FORMULA_IMAGE_VERSION 1
+
+// A work message is its state (in one of these formats), then bundled
+// conflict clauses, then the task, the bundle's size and the format
+#define WORK_TRAILER_INTS 5
+#define WORK_FORMAT_BITMAP 0
+#define WORK_FORMAT_CUBE 1
+#define WORK_FORMAT_PACKED 2
+
+// Number of ints in a formula image with this header
+int formula_image_ints(FormulaImageHeader header);
+
+// Path of the cached base formula for a grid size, reduction and encodings
+std::string formula_template_path(int n, int reduction_method, short *encodings);
+
+// Maps a cached base formula, encoding and caching it first on a miss.
+// Returns NULL when the cache can not be used.
+int *map_formula_template(
+    short pid,
+    short nprocs,
+    int n, 
+    int sqrt_n, 
+    int reduction_method, 
+    short *encodings, 
+    size_t *num_bytes);
+
+// Returns the printable name of an encoding
+std::string encoding_name(short encoding);
+
+// Returns the encoding a group type uses when none is given with -e
+short default_encoding(int n, int group_type, int reduction_method);
+
+// Fills resolved with the encodings actually used, encodings may be NULL
+void resolve_encodings(int n, int reduction_method, short *encodings, short *resolved);
+
+// Parses "e" or "cell,row,col,box,cage" into encodings, returns success
+bool parse_encodings(std::string arg, short *encodings);
+
+// Gets the exact variables and clauses one encoded group of a length adds
+void encoding_size(
+    short encoding, 
+    int length, 
+    bool exactly_one, 
+    int *num_vars, 
+    int *num_clauses);
+
 class Cnf {
     public:
         Clauses clauses; // dynamic number
         VariableLocations *variables; // static number
         Deque edit_stack;
+        Deque level_changes; // LevelChanges per edit_stack group, same order
+        Deque retired_edit_groups; // pruned groups waiting to be freed
         unsigned int *oldest_compressed;
         short pid;
         short nprocs;
@@ -51,6 +153,10 @@ class Cnf {
         int ints_needed_for_conflict_clauses;
         int ints_needed_for_vars;
         int work_ints;
+        // Literals (var id + 1, negated when false) that lead to the oldest
+        // compressed state, unless it came from bitmap work
+        std::vector<int> oldest_cube;
+        bool cube_known;
         bool *assigned_true;
         bool *assigned_false;
         // Used to determine who needs a conflict clause
@@ -68,6 +174,12 @@ class Cnf {
         int n;
         int depth;
         int reduction_method;
+        // Whether the last reconstruct_state only applied a difference
+        bool last_reconstruct_incremental;
+        short encodings[NUM_GROUP_TYPES];
+        // When set, encoders only count what they would add to the formula
+        bool counting_only;
+        int counted_clauses;
         std::string depth_str;
 
         // Makes CNF formula from inputs
@@ -80,7 +192,9 @@ class Cnf {
             int num_constraints,
             int num_assignments,
             int reduction_method,
-            GridAssignment *assignments);
+            GridAssignment *assignments,
+            short *encodings = NULL,
+            bool use_templates = false);
         // Makes CNF formula from premade data structures
         Cnf(
             short pid,
@@ -91,21 +205,79 @@ class Cnf {
         // Default constructor
         Cnf();
 
+        // Serializes the formula into a flat image, returns a malloced copy
+        int *to_formula_image(int *num_ints);
+
+        // Makes CNF formula from an image, without re-encoding anything
+        void load_formula_image(short pid, short nprocs, int *image);
+
+        // Copies an image's clauses and variables, leaving room for extras.
+        // Returns the number of variables in the image.
+        int read_formula_image(int *image, int numExtraVars, int numExtraClauses);
+
         // Adds a clause to data structures
         void add_clause(
             Clause new_clause, 
             Clauses &clauses, 
             VariableLocations *variables);
 
+        // Adds an encoding clause, or only counts it when counting_only
+        void encode_clause(Clause new_clause);
+
+        // Sorts literals into a new encoding clause and adds it
+        void encode_clause(int *ids, bool *signs, int length);
+
+        // Makes a fresh auxiliary variable, returns its id
+        int new_auxiliary_variable(int &var_id);
+
+        // Encodes that at most (or exactly) one of the vars is true
+        void encode_group(
+            short encoding, 
+            int *vars, 
+            int length, 
+            int &var_id, 
+            bool exactly_one);
+
+        // At-most-one over every pair of vars
+        void amo_pairwise(int *vars, int length);
+
+        // At-most-one with commanders over groups of three
+        void amo_commander(int *vars, int length, int &var_id);
+
+        // At-most-one with a sequential counter
+        void amo_sequential(int *vars, int length, int &var_id);
+
+        // At-most-one with row and column coordinates on a grid
+        void amo_product(int *vars, int length, int &var_id);
+
+        // At-most-one with binary commanders over pairs
+        void amo_bimander(int *vars, int length, int &var_id);
+
+        // Ladder (regular) encoding, exactly-one when channelled fully
+        void amo_ladder(int *vars, int length, int &var_id, bool exactly_one);
+
         std::tuple<int, bool> oneOfClause(int* vars, int length, int &var_id, bool beginning=true, int newComm=-1, bool newCommSign=false);
 
         // Working version that reduces the number of clauses needed
         int reduce_puzzle_clauses_truncated(int n, int sqrt_n, int num_assignments, GridAssignment* assignments,
             int numExtraVars, int numExtraClauses);
 
-        // helper for reduce_constraints
-        std::vector<std::vector<int>> generatePartitions(int sum, int size, int max);
-        int generatePartitionsNum(int sum, int size, int max);
+        // Reduction with a selectable encoding per group type
+        int reduce_puzzle_encoded(
+            int n, 
+            int sqrt_n, 
+            int num_assignments, 
+            GridAssignment *assignments,
+            int numExtraVars, 
+            int numExtraClauses);
+
+        // Base formula from a cached template, then the givens
+        int reduce_puzzle_template(
+            int *base_image, 
+            int num_assignments, 
+            GridAssignment *assignments,
+            int numExtraVars, 
+            int numExtraClauses);
 
         // Reduces sum constraints
         void reduce_constraints(int n, int &var_id, int num_constraints, int** constraints);
@@ -214,14 +386,57 @@ class Cnf {
         // Updates internal variables based on a recursive call
         void recurse();
 
+        // Drops the oldest edit group, adding its changes to the oldest
+        // compressed state. The group itself is freed later
+        void prune_oldest_edit_group();
+
+        // Frees edit groups dropped by prune_oldest_edit_group
+        void free_retired_edit_groups();
+
         // Returns the task embedded in the work received
-        Task extract_task_from_work(void *work);
+        Task extract_task_from_work(void *work, int num_ints);
+
+        // Returns copies of the conflict clauses bundled with the work received
+        std::vector<Clause> extract_clauses_from_work(void *work, int num_ints);
+
+        // Collects the shortest conflict clauses a compressed state leaves
+        // open, as a length followed by literals for each
+        void bundle_conflict_clauses(unsigned int *compressed, std::vector<int> &bundle);
+
+        // Reconstructs one's own formula (state) from an integer representation.
+        // Returns whether work was kept as the oldest state, else the caller
+        // still owns it.
+        bool reconstruct_state(void *work, int num_ints, Deque &task_stack);
+
+        // Adds an assigned variable to the oldest cube, unless unit
+        // propagation over the normal clauses rederives it
+        void add_to_cube(int var_id);
+
+        // Makes the compressed state that assigns just the literals of a cube
+        unsigned int *cube_to_compressed(int *cube, int num_literals);
+
+        // Encodes the sections of a compressed state, returns the bytes written
+        int pack_compressed(unsigned int *compressed, unsigned char *packed);
+
+        // Decodes packed sections into a new compressed state
+        unsigned int *unpack_compressed(unsigned char *packed);
+
+        // Collects the normal clauses a compressed state changes relative to
+        // the current one. Returns false when a full reconstruct is cheaper.
+        bool find_changed_clauses(unsigned int *compressed, std::vector<int> &changed_clauses);
+
+        // Sets one normal clause's drop and size from the current assignment
+        void reconstruct_clause(int clause_id, bool should_be_dropped);
+
+        // Testing method only, whether the formula matches a compressed state
+        bool state_matches_compressed(unsigned int *compressed);
 
-        // Reconstructs one's own formula (state) from an integer representation
-        void reconstruct_state(void *work, Deque &task_stack);
+        // Converts task + state (packed, or its cube when smaller) into work
+        // message, returns a COPY of the data
+        void *convert_to_work_message(unsigned int *compressed, Task task, int *num_ints);
 
-        // Converts task + state into work message, returns a COPY of the data
-        void *convert_to_work_message(unsigned int *compressed, Task task);
+        // Returns the size of the largest message a rank can be sent
+        int max_message_bytes();
         
         // Converts current formula to integer representation
         unsigned int *to_int_rep();
@@ -0,0 +1,379 @@
+#include "cnf.h"
+#include <string>
+#include <vector>
+#include <cassert>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+//----------------------------------------------------------------
+// BEGIN IMPLEMENTATION
+//----------------------------------------------------------------
+
+// Returns the printable name of an encoding
+std::string encoding_name(short encoding) {
+    switch (encoding) {
+        case ENCODING_PAIRWISE: return "pairwise";
+        case ENCODING_COMMANDER: return "commander";
+        case ENCODING_SEQUENTIAL: return "sequential";
+        case ENCODING_PRODUCT: return "product";
+        case ENCODING_BIMANDER: return "bimander";
+        case ENCODING_LADDER: return "ladder";
+    }
+    return "default";
+}
+
+// Returns the encoding a group type uses when none is given with -e
+short default_encoding(int n, int group_type, int reduction_method) {
+    if (reduction_method != 2) {
+        // Cages keep the pairwise uniqueness clauses they always had
+        return ENCODING_PAIRWISE;
+    }
+    // Fastest single process solves in -c benchmark
+    if (n <= 9) {
+        return ENCODING_SEQUENTIAL;
+    }
+    return ENCODING_PRODUCT;
+}
+
+// Fills resolved with the encodings actually used, encodings may be NULL
+void resolve_encodings(int n, int reduction_method, short *encodings, short *resolved) {
+    for (int group_type = 0; group_type < NUM_GROUP_TYPES; group_type++) {
+        short encoding = encodings == NULL ? ENCODING_DEFAULT : encodings[group_type];
+        if (encoding == ENCODING_DEFAULT) {
+            encoding = default_encoding(n, group_type, reduction_method);
+        }
+        resolved[group_type] = encoding;
+    }
+}
+
+// Parses "e" or "cell,row,col,box,cage" into encodings, returns success
+bool parse_encodings(std::string arg, short *encodings) {
+    int values[NUM_GROUP_TYPES];
+    int num_values = 0;
+    size_t start = 0;
+    while (start <= arg.size()) {
+        size_t end = arg.find(',', start);
+        if (end == std::string::npos) end = arg.size();
+        std::string token = arg.substr(start, end - start);
+        if (token.empty() || num_values == NUM_GROUP_TYPES) return false;
+        for (char c : token) {
+            if (c < '0' || c > '9') return false;
+        }
+        values[num_values] = atoi(token.c_str());
+        if (values[num_values] >= NUM_ENCODINGS) return false;
+        num_values++;
+        start = end + 1;
+    }
+    if (num_values != 1 && num_values != NUM_GROUP_TYPES) return false;
+    for (int group_type = 0; group_type < NUM_GROUP_TYPES; group_type++) {
+        encodings[group_type] = (short)(num_values == 1 ? values[0] : values[group_type]);
+    }
+    return true;
+}
+
+// Gets the exact variables and clauses one encoded group of a length adds
+void encoding_size(
+        short encoding,
+        int length,
+        bool exactly_one,
+        int *num_vars,
+        int *num_clauses)
+    {
+    // Dry run of the real encoder, so the figures can never drift
+    Cnf counter;
+    counter.counting_only = true;
+    int vars[length];
+    for (int i = 0; i < length; i++) {
+        vars[i] = i;
+    }
+    int var_id = length;
+    counter.encode_group(encoding, vars, length, var_id, exactly_one);
+    *num_vars = var_id - length;
+    *num_clauses = counter.counted_clauses;
+}
+
+// Adds an encoding clause, or only counts it when counting_only
+void Cnf::encode_clause(Clause new_clause) {
+    if (Cnf::counting_only) {
+        Cnf::counted_clauses++;
+        free_clause(new_clause);
+        return;
+    }
+    add_clause(new_clause, Cnf::clauses, Cnf::variables);
+}
+
+// Sorts literals into a new encoding clause and adds it
+void Cnf::encode_clause(int *ids, bool *signs, int length) {
+    if (Cnf::counting_only) {
+        Cnf::counted_clauses++;
+        return;
+    }
+    Clause new_clause;
+    new_clause.num_literals = length;
+    new_clause.literal_variable_ids = (int *)malloc(sizeof(int) * length);
+    new_clause.literal_signs = (bool *)malloc(sizeof(bool) * length);
+    // Insertion sort, clauses made here are short
+    for (int i = 0; i < length; i++) {
+        int j = i;
+        while (j > 0 && new_clause.literal_variable_ids[j - 1] > ids[i]) {
+            new_clause.literal_variable_ids[j] = new_clause.literal_variable_ids[j - 1];
+            new_clause.literal_signs[j] = new_clause.literal_signs[j - 1];
+            j--;
+        }
+        new_clause.literal_variable_ids[j] = ids[i];
+        new_clause.literal_signs[j] = signs[i];
+    }
+    add_clause(new_clause, Cnf::clauses, Cnf::variables);
+}
+
+// Makes a fresh auxiliary variable, returns its id
+int Cnf::new_auxiliary_variable(int &var_id) {
+    int new_var_id = var_id;
+    var_id++;
+    if (Cnf::counting_only) {
+        return new_var_id;
+    }
+    VariableLocations aux_variable;
+    aux_variable.clauses_containing = new std::vector<int>();
+    aux_variable.variable_id = new_var_id;
+    Cnf::true_assignment_statuses[new_var_id] = 'u';
+    Cnf::false_assignment_statuses[new_var_id] = 'u';
+    Cnf::variables[new_var_id] = aux_variable;
+    return new_var_id;
+}
+
+// Encodes that at most (or exactly) one of the vars is true
+void Cnf::encode_group(
+        short encoding,
+        int *vars,
+        int length,
+        int &var_id,
+        bool exactly_one)
+    {
+    if (length <= 1) {
+        if (length == 1 && exactly_one) {
+            bool sign = true;
+            encode_clause(vars, &sign, 1);
+        }
+        return;
+    }
+    if (exactly_one && encoding == ENCODING_COMMANDER) {
+        // The original commander encoding already includes at-least-one
+        oneOfClause(vars, length, var_id);
+        return;
+    }
+    if (exactly_one && encoding == ENCODING_LADDER && length > 2) {
+        // Fully channelled ladder implies at-least-one by itself
+        amo_ladder(vars, length, var_id, true);
+        return;
+    }
+    if (exactly_one) {
+        bool signs[length];
+        for (int i = 0; i < length; i++) {
+            signs[i] = true;
+        }
+        encode_clause(vars, signs, length);
+    }
+    switch (encoding) {
+        case ENCODING_PAIRWISE: {
+            amo_pairwise(vars, length);
+            break;
+        } case ENCODING_COMMANDER: {
+            amo_commander(vars, length, var_id);
+            break;
+        } case ENCODING_SEQUENTIAL: {
+            amo_sequential(vars, length, var_id);
+            break;
+        } case ENCODING_PRODUCT: {
+            amo_product(vars, length, var_id);
+            break;
+        } case ENCODING_BIMANDER: {
+            amo_bimander(vars, length, var_id);
+            break;
+        } case ENCODING_LADDER: {
+            amo_ladder(vars, length, var_id, false);
+            break;
+        } default: {
+            raise_error("Unknown encoding " + std::to_string(encoding));
+        }
+    }
+}
+
+// At-most-one over every pair of vars
+void Cnf::amo_pairwise(int *vars, int length) {
+    for (int i = 0; i < length; i++) {
+        for (int j = i + 1; j < length; j++) {
+            int ids[2] = {vars[i], vars[j]};
+            bool signs[2] = {false, false};
+            encode_clause(ids, signs, 2);
+        }
+    }
+}
+
+// At-most-one with commanders over groups of three
+void Cnf::amo_commander(int *vars, int length, int &var_id) {
+    if (length <= 3) {
+        amo_pairwise(vars, length);
+        return;
+    }
+    int num_groups = ceil_div(length, 3);
+    int commanders[num_groups];
+    for (int group = 0; group < num_groups; group++) {
+        int *group_vars = vars + 3 * group;
+        int group_length = std::min(3, length - 3 * group);
+        if (group_length == 1) {
+            commanders[group] = group_vars[0];
+            continue;
+        }
+        commanders[group] = new_auxiliary_variable(var_id);
+        amo_pairwise(group_vars, group_length);
+        // var -> commander
+        for (int i = 0; i < group_length; i++) {
+            int ids[2] = {group_vars[i], commanders[group]};
+            bool signs[2] = {false, true};
+            encode_clause(ids, signs, 2);
+        }
+    }
+    amo_commander(commanders, num_groups, var_id);
+}
+
+// At-most-one with a sequential counter
+void Cnf::amo_sequential(int *vars, int length, int &var_id) {
+    if (length <= 2) {
+        amo_pairwise(vars, length);
+        return;
+    }
+    // counter[i] means one of vars[0..i] is true
+    int counter[length - 1];
+    for (int i = 0; i < length - 1; i++) {
+        counter[i] = new_auxiliary_variable(var_id);
+    }
+    for (int i = 0; i < length; i++) {
+        if (i < length - 1) {
+            int ids[2] = {vars[i], counter[i]};
+            bool signs[2] = {false, true};
+            encode_clause(ids, signs, 2);
+        }
+        if (i > 0) {
+            int ids[2] = {vars[i], counter[i - 1]};
+            bool signs[2] = {false, false};
+            encode_clause(ids, signs, 2);
+        }
+        if (i > 0 && i < length - 1) {
+            int ids[2] = {counter[i - 1], counter[i]};
+            bool signs[2] = {false, true};
+            encode_clause(ids, signs, 2);
+        }
+    }
+}
+
+// At-most-one with row and column coordinates on a grid
+void Cnf::amo_product(int *vars, int length, int &var_id) {
+    if (length <= 4) {
+        amo_pairwise(vars, length);
+        return;
+    }
+    int num_rows = (int)ceil(sqrt((double)length));
+    int num_cols = ceil_div(length, num_rows);
+    int rows[num_rows];
+    int cols[num_cols];
+    for (int row = 0; row < num_rows; row++) {
+        rows[row] = new_auxiliary_variable(var_id);
+    }
+    for (int col = 0; col < num_cols; col++) {
+        cols[col] = new_auxiliary_variable(var_id);
+    }
+    for (int i = 0; i < length; i++) {
+        int row_ids[2] = {vars[i], rows[i / num_cols]};
+        int col_ids[2] = {vars[i], cols[i % num_cols]};
+        bool signs[2] = {false, true};
+        encode_clause(row_ids, signs, 2);
+        encode_clause(col_ids, signs, 2);
+    }
+    amo_product(rows, num_rows, var_id);
+    amo_product(cols, num_cols, var_id);
+}
+
+// At-most-one with binary commanders over pairs
+void Cnf::amo_bimander(int *vars, int length, int &var_id) {
+    int num_groups = ceil_div(length, 2);
+    if (num_groups <= 1) {
+        amo_pairwise(vars, length);
+        return;
+    }
+    int num_bits = 0;
+    while ((1 << num_bits) < num_groups) {
+        num_bits++;
+    }
+    int bits[num_bits];
+    for (int bit = 0; bit < num_bits; bit++) {
+        bits[bit] = new_auxiliary_variable(var_id);
+    }
+    for (int group = 0; group < num_groups; group++) {
+        int *group_vars = vars + 2 * group;
+        int group_length = std::min(2, length - 2 * group);
+        amo_pairwise(group_vars, group_length);
+        // var -> bits spell out its group number
+        for (int i = 0; i < group_length; i++) {
+            for (int bit = 0; bit < num_bits; bit++) {
+                int ids[2] = {group_vars[i], bits[bit]};
+                bool signs[2] = {false, (bool)((group >> bit) & 1)};
+                encode_clause(ids, signs, 2);
+            }
+        }
+    }
+}
+
+// Ladder (regular) encoding, exactly-one when channelled fully
+void Cnf::amo_ladder(int *vars, int length, int &var_id, bool exactly_one) {
+    if (length <= 2) {
+        amo_pairwise(vars, length);
+        return;
+    }
+    // rungs[i] means the true var comes after vars[i]
+    int rungs[length - 1];
+    for (int i = 0; i < length - 1; i++) {
+        rungs[i] = new_auxiliary_variable(var_id);
+    }
+    for (int i = 0; i < length - 2; i++) {
+        int ids[2] = {rungs[i], rungs[i + 1]};
+        bool signs[2] = {true, false};
+        encode_clause(ids, signs, 2);
+    }
+    for (int i = 0; i < length; i++) {
+        if (i > 0) {
+            int ids[2] = {vars[i], rungs[i - 1]};
+            bool signs[2] = {false, true};
+            encode_clause(ids, signs, 2);
+        }
+        if (i < length - 1) {
+            int ids[2] = {vars[i], rungs[i]};
+            bool signs[2] = {false, false};
+            encode_clause(ids, signs, 2);
+        }
+    }
+    if (!exactly_one) {
+        return;
+    }
+    // var <- (previous rung and not own rung)
+    for (int i = 0; i < length; i++) {
+        if (i == 0) {
+            int ids[2] = {vars[i], rungs[i]};
+            bool signs[2] = {true, true};
+            encode_clause(ids, signs, 2);
+        } else if (i == length - 1) {
+            int ids[2] = {vars[i], rungs[i - 1]};
+            bool signs[2] = {true, false};
+            encode_clause(ids, signs, 2);
+        } else {
+            int ids[3] = {vars[i], rungs[i - 1], rungs[i]};
+            bool signs[3] = {true, false, true};
+            encode_clause(ids, signs, 3);
+        }
+    }
+}
+
+//----------------------------------------------------------------
+// END IMPLEMENTATION
+//----------------------------------------------------------------
@@ -6,6 +6,11 @@
 #include <limits.h>
 #include <cassert>
 #include <mpi.h>
+#include <cstdint>
+#include <cstring>
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
 
 //----------------------------------------------------------------
 // BEGIN IMPLEMENTATION
@@ -200,22 +205,30 @@ bool variable_in_clause(Clause clause, int var_id, bool *sign) {
     return false;
 }
 
-// Converts a message received to a clause
-Clause message_to_clause(Message message) {
+// Converts a batch of clauses received, populating the rank that learned
+// them. The batch is that rank then each clause's length and literals.
+std::vector<Clause> message_to_clauses(Message message, short *origin) {
     assert(message.type == 6);
-    int num_lits = message.size / (sizeof(bool) + sizeof(int));
-    bool *signs = (bool *)message.data;
-    int *vars = (int *)(signs + num_lits);
-    Clause result;
-    result.num_literals = num_lits;
-    result.literal_signs = (bool *)malloc(sizeof(bool) * num_lits);
-    result.literal_variable_ids = (int *)malloc(sizeof(int) * num_lits);
-    for (int i = 0; i < num_lits; i++) {
-        result.literal_signs[i] = signs[i];
-        result.literal_variable_ids[i] = vars[i];
+    int num_ints = message.size / sizeof(int);
+    int *batch = (int *)message.data;
+    std::vector<Clause> results;
+    *origin = batch[0];
+    int position = 1;
+    while (position < num_ints) {
+        Clause result;
+        int num_lits = batch[position++];
+        result.num_literals = num_lits;
+        result.literal_signs = (bool *)malloc(sizeof(bool) * num_lits);
+        result.literal_variable_ids = (int *)malloc(sizeof(int) * num_lits);
+        for (int i = 0; i < num_lits; i++) {
+            int literal = batch[position++];
+            result.literal_signs[i] = literal > 0;
+            result.literal_variable_ids[i] = (literal > 0 ? literal : -literal) - 1;
+        }
+        results.push_back(result);
     }
-    
-    return result;
+    assert(position == num_ints);
+    return results;
 }
 
 // Makes an assignment ready for a data structure from arguments
@@ -435,34 +448,235 @@ int ceil_div(int num, int denom) {
   return result;
 }
 
-// Reads 32 bits from bits array as a single signed integer
-unsigned int bits_to_int(bool *bits) {
+// Packs 8 bools (one byte each) into the low 8 bits of a word
+static inline unsigned int pack_byte_bits(const bool *bits) {
+    uint64_t lanes;
+    memcpy(&lanes, bits, 8);
+#if defined(__BMI2__)
+    return (unsigned int)_pext_u64(lanes, 0x0101010101010101ULL);
+#elif __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Each 0/1 byte lands on its own bit of the top byte
+    return (unsigned int)((lanes * 0x0102040810204080ULL) >> 56);
+#else
     unsigned int value = 0;
-    unsigned int running = 1;
-    for (int i = 0; i < 32; i++) {
-        if (bits[i]) {
-            value += running;
-        }
-        running *= 2;
+    for (int i = 0; i < 8; i++) {
+        value |= ((unsigned int)bits[i]) << i;
     }
     return value;
+#endif
 }
 
-// Reads integer into 32 bit array
-bool *int_to_bits(unsigned int value) {
-    bool *bits = (bool *)malloc(sizeof(bool) * 32);
-    unsigned int current = value;
-    unsigned int running = (1 << 31);
-    for (int i = 31; i >= 0; i--) {
-        if (current >= running) {
-            current -= running;
-            bits[i] = true;
-        } else {
-            bits[i] = false;
+// Spreads the low 8 bits of a word into 8 bools (one byte each)
+static inline void unpack_byte_bits(unsigned int value, bool *bits) {
+#if defined(__BMI2__)
+    uint64_t lanes = _pdep_u64(value & 0xff, 0x0101010101010101ULL);
+    memcpy(bits, &lanes, 8);
+#elif __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Byte i keeps only bit i, then any nonzero byte becomes 1
+    uint64_t lanes = ((uint64_t)(value & 0xff) * 0x0101010101010101ULL) & 0x8040201008040201ULL;
+    lanes = ((lanes + 0x7f7f7f7f7f7f7f7fULL) & 0x8080808080808080ULL) >> 7;
+    memcpy(bits, &lanes, 8);
+#else
+    for (int i = 0; i < 8; i++) {
+        bits[i] = (value >> i) & 1;
+    }
+#endif
+}
+
+// Reads 32 bits from bits array as a single unsigned integer
+unsigned int bits_to_int(const bool *bits) {
+    return pack_byte_bits(bits) 
+        | (pack_byte_bits(bits + 8) << 8) 
+        | (pack_byte_bits(bits + 16) << 16) 
+        | (pack_byte_bits(bits + 24) << 24);
+}
+
+// Writes integer into a 32 bit array
+void int_to_bits(unsigned int value, bool *bits) {
+    unpack_byte_bits(value, bits);
+    unpack_byte_bits(value >> 8, bits + 8);
+    unpack_byte_bits(value >> 16, bits + 16);
+    unpack_byte_bits(value >> 24, bits + 24);
+}
+
+// Packs whole bool arrays into words, 32 bools per word
+void pack_bits(const bool *bits, unsigned int *words, int num_words) {
+    for (int word = 0; word < num_words; word++) {
+        words[word] = bits_to_int(bits + 32 * word);
+    }
+}
+
+// Unpacks words into whole bool arrays, 32 bools per word
+void unpack_bits(const unsigned int *words, bool *bits, int num_words) {
+    for (int word = 0; word < num_words; word++) {
+        int_to_bits(words[word], bits + 32 * word);
+    }
+}
+
+// Bytes a varint takes, 7 bits per byte
+static inline int varint_size(unsigned int value) {
+    return 1 + (value >= (1u << 7)) + (value >= (1u << 14)) 
+        + (value >= (1u << 21)) + (value >= (1u << 28));
+}
+
+// Writes a varint, returns the byte after it
+static inline unsigned char *write_varint(unsigned int value, unsigned char *out) {
+    while (value >= 0x80) {
+        *(out++) = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    *(out++) = (unsigned char)value;
+    return out;
+}
+
+// Reads a varint, returns the byte after it
+static inline const unsigned char *read_varint(const unsigned char *in, unsigned int *value) {
+    unsigned int result = 0;
+    int shift = 0;
+    while (*in & 0x80) {
+        result |= (unsigned int)(*(in++) & 0x7f) << shift;
+        shift += 7;
+    }
+    *value = result | ((unsigned int)*(in++) << shift);
+    return in;
+}
+
+// Word with the bits a list of this kind holds: set bits, clear bits, or
+// the starts of runs (bits that differ from the one before), tail cleared
+static inline unsigned int listed_bits(
+        const unsigned int *words, 
+        int word, 
+        int num_bits, 
+        unsigned char kind) 
+    {
+    unsigned int bits = words[word];
+    if (kind == BITSET_CLEAR_LIST) {
+        bits = ~bits;
+    } else if (kind == BITSET_RUN_LIST) {
+        unsigned int carry = word > 0 ? words[word - 1] >> 31 : 0;
+        bits ^= (bits << 1) | carry;
+    }
+    int tail = num_bits - 32 * word;
+    return tail < 32 ? bits & ((1u << tail) - 1) : bits;
+}
+
+// Bytes a list of this kind takes, or limit + 1 once past limit
+static int bit_list_size(
+        const unsigned int *words, 
+        int num_bits, 
+        unsigned char kind, 
+        int limit) 
+    {
+    int num_words = ceil_div(num_bits, 32);
+    int size = 0;
+    int count = 0;
+    int previous = -1;
+    for (int word = 0; word < num_words; word++) {
+        unsigned int bits = listed_bits(words, word, num_bits, kind);
+        while (bits != 0) {
+            int position = 32 * word + __builtin_ctz(bits);
+            size += varint_size(position - previous - 1);
+            previous = position;
+            count++;
+            bits &= bits - 1;
+        }
+        if (size > limit) {
+            return limit + 1;
+        }
+    }
+    return size + varint_size(count);
+}
+
+// Writes a list of this kind as its length and then the gaps between bits
+static unsigned char *write_bit_list(
+        const unsigned int *words, 
+        int num_bits, 
+        unsigned char kind, 
+        unsigned char *out) 
+    {
+    int num_words = ceil_div(num_bits, 32);
+    int count = 0;
+    for (int word = 0; word < num_words; word++) {
+        count += __builtin_popcount(listed_bits(words, word, num_bits, kind));
+    }
+    out = write_varint(count, out);
+    int previous = -1;
+    for (int word = 0; word < num_words; word++) {
+        unsigned int bits = listed_bits(words, word, num_bits, kind);
+        while (bits != 0) {
+            int position = 32 * word + __builtin_ctz(bits);
+            out = write_varint(position - previous - 1, out);
+            previous = position;
+            bits &= bits - 1;
+        }
+    }
+    return out;
+}
+
+// Encodes the first num_bits bits of words as raw words, or as a list of
+// varint gaps between set bits, clear bits or run boundaries
+int encode_bitset(const unsigned int *words, int num_bits, unsigned char *out) {
+    int num_words = ceil_div(num_bits, 32);
+    unsigned char best_kind = BITSET_RAW;
+    int best_size = 4 * num_words;
+    for (unsigned char kind : {BITSET_SET_LIST, BITSET_CLEAR_LIST, BITSET_RUN_LIST}) {
+        int size = bit_list_size(words, num_bits, kind, best_size);
+        if (size < best_size) {
+            best_kind = kind;
+            best_size = size;
         }
-        running = (running >> 1);
     }
-    return bits;
+    out[0] = best_kind;
+    if (best_kind == BITSET_RAW) {
+        memcpy(out + 1, words, best_size);
+        return 1 + best_size;
+    }
+    return write_bit_list(words, num_bits, best_kind, out + 1) - out;
+}
+
+// Decodes a bitset written by encode_bitset, returns the bytes read
+int decode_bitset(const unsigned char *in, unsigned int *words, int num_bits) {
+    int num_words = ceil_div(num_bits, 32);
+    unsigned char kind = in[0];
+    if (kind == BITSET_RAW) {
+        memcpy(words, in + 1, 4 * num_words);
+        return 1 + 4 * num_words;
+    }
+    assert(kind == BITSET_SET_LIST || kind == BITSET_CLEAR_LIST || kind == BITSET_RUN_LIST);
+    memset(words, 0, 4 * num_words);
+    const unsigned char *position_ptr = in + 1;
+    unsigned int count;
+    position_ptr = read_varint(position_ptr, &count);
+    int position = -1;
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int gap;
+        position_ptr = read_varint(position_ptr, &gap);
+        position += gap + 1;
+        assert(position < num_bits);
+        words[position / 32] |= 1u << (position % 32);
+    }
+    if (kind == BITSET_CLEAR_LIST) {
+        for (int word = 0; word < num_words; word++) {
+            words[word] = listed_bits(words, word, num_bits, BITSET_CLEAR_LIST);
+        }
+    } else if (kind == BITSET_RUN_LIST) {
+        // A bit is the parity of the run starts up to it, a word at a time
+        unsigned int carry = 0;
+        for (int word = 0; word < num_words; word++) {
+            unsigned int bits = words[word];
+            bits ^= bits << 1;
+            bits ^= bits << 2;
+            bits ^= bits << 4;
+            bits ^= bits << 8;
+            bits ^= bits << 16;
+            words[word] = bits ^ carry;
+            carry = (words[word] >> 31) ? ~0u : 0;
+        }
+        if (num_bits % 32 != 0) {
+            words[num_words - 1] &= (1u << (num_bits % 32)) - 1;
+        }
+    }
+    return position_ptr - in;
 }
 
 IndexableDLL::IndexableDLL(int num_to_index) {
@@ -1521,43 +1735,57 @@ void IntDeque::free_deque() {
     free(IntDeque::tail);
 }
 
-// Adds value to back of queue
-void DeadMessageQueue::add_to_queue(void *message, MPI_Request request) {
-  DeadMessageLinkedList current;
-  current.message_id = DeadMessageQueue::index;
-  current.message = message;
-  current.request = request;
-  if (DeadMessageQueue::count == 0) {
-    DeadMessageQueue::head = (DeadMessageLinkedList *)malloc(sizeof(DeadMessageLinkedList));
-    DeadMessageQueue::tail = DeadMessageQueue::head;
-    *DeadMessageQueue::head = current;
-  } else {
-    DeadMessageLinkedList tail = *(DeadMessageQueue::tail);
-    tail.next = (DeadMessageLinkedList *)malloc(sizeof(DeadMessageLinkedList));
-    *tail.next = current;
-    *(DeadMessageQueue::tail) = tail;
-    DeadMessageQueue::tail = tail.next;
-  }
-  DeadMessageQueue::count++;
-  DeadMessageQueue::index++;
+//----------------------------------------------------------------
+// END IMPLEMENTATION
+//----------------------------------------------------------------
+
+// Default constructor
+MessageRing::MessageRing() {
+    MessageRing::slots = NULL;
+    MessageRing::capacity = 0;
+    MessageRing::head = 0;
+    MessageRing::tail = 0;
+}
+
+// Allocates room for capacity messages
+void MessageRing::init(unsigned int capacity) {
+    assert((capacity & (capacity - 1)) == 0);
+    MessageRing::slots = (Message *)malloc(sizeof(Message) * capacity);
+    MessageRing::capacity = capacity;
+    MessageRing::head = 0;
+    MessageRing::tail = 0;
+}
+
+// Adds a message at the back, returns false if the ring is full
+bool MessageRing::push(Message message) {
+    unsigned int tail = MessageRing::tail;
+    if (tail - __atomic_load_n(&(MessageRing::head), __ATOMIC_ACQUIRE) == MessageRing::capacity) {
+        return false;
+    }
+    MessageRing::slots[tail & (MessageRing::capacity - 1)] = message;
+    __atomic_store_n(&(MessageRing::tail), tail + 1, __ATOMIC_RELEASE);
+    return true;
 }
 
-// Pops value from front of queue
-void *DeadMessageQueue::pop_from_front() {
-  DeadMessageLinkedList current = *(DeadMessageQueue::head);
-  free(DeadMessageQueue::head);
-  DeadMessageQueue::head = current.next;
-  DeadMessageQueue::count--;
-  return current.message;
+// Removes the front message, returns false if the ring is empty
+bool MessageRing::pop(Message &message) {
+    unsigned int head = MessageRing::head;
+    if (head == __atomic_load_n(&(MessageRing::tail), __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    message = MessageRing::slots[head & (MessageRing::capacity - 1)];
+    __atomic_store_n(&(MessageRing::head), head + 1, __ATOMIC_RELEASE);
+    return true;
 }
 
-// Returns the front value without removing it
-MPI_Request DeadMessageQueue::peak_front(int *id_ptr) {
-  DeadMessageLinkedList current = *(DeadMessageQueue::head);
-  *id_ptr = current.message_id;
-  return current.request;
+// Returns whether a push would fail
+bool MessageRing::full() {
+    return MessageRing::tail - __atomic_load_n(&(MessageRing::head), __ATOMIC_ACQUIRE) 
+        == MessageRing::capacity;
 }
 
-//----------------------------------------------------------------
-// END IMPLEMENTATION
-//----------------------------------------------------------------
\ No newline at end of file
+// Frees all data structures
+void MessageRing::free_ring() {
+    free(MessageRing::slots);
+    MessageRing::slots = NULL;
+}
@@ -2,6 +2,7 @@
 #define HELPERS_H
 
 #include <string>
+#include <vector>
 #include "mpi.h"
 
 // Print control variables
@@ -18,13 +19,31 @@
 
 #define CYCLES_TO_PRINT_PROGRESS 10000
 
+#ifndef PRINT_STEAL_STATS
+// Prints per rank reconstruct and time-to-first-decision figures
+#define PRINT_STEAL_STATS 0
+#endif
+
 // Decision order control variables
 
 #define BIAS_CLAUSES_OF_SIZES_CHANGED 1
 
 #define ALWAYS_PREFER_NORMAL_VARS 0
 
-#define CYCLES_TO_RECEIVE_MESSAGES 100
+#ifndef POLL_TARGET_MICROSECONDS
+// Longest a message should wait for a busy rank to poll
+#define POLL_TARGET_MICROSECONDS 200
+#endif
+
+#ifndef POLL_MAX_ITERATIONS
+// Most solve iterations between polls however fast they run
+#define POLL_MAX_ITERATIONS 10000
+#endif
+
+#ifndef POLL_SMOOTHING
+// Weight of the newest sample in the iteration time and arrival averages
+#define POLL_SMOOTHING 0.25
+#endif
 
 // Conflict resolution control variables
 
@@ -42,6 +61,135 @@
 
 #define SEND_CONFLICT_CLAUSES 1
 
+// Work stealing control variables
+
+#ifndef INCREMENTAL_RECONSTRUCT
+// Thieves patch only what differs from their current state when it is small
+#define INCREMENTAL_RECONSTRUCT 1
+#endif
+
+#ifndef CUBE_WORK_MESSAGES
+// Work is sent as its decision literals when that beats the bitmaps
+#define CUBE_WORK_MESSAGES 1
+#endif
+
+#ifndef PACKED_WORK_MESSAGES
+// Bitmap work sends each section raw or as a list, whichever is smaller
+#define PACKED_WORK_MESSAGES 1
+#endif
+
+#ifndef WORK_BUNDLE_CLAUSES
+// Most conflict clauses sent along with one piece of work, shortest first
+#define WORK_BUNDLE_CLAUSES 16
+#endif
+
+#ifndef MIN_STEAL_LOG_SIZE
+// Steals are declined below an estimated 2^MIN_STEAL_LOG_SIZE nodes
+#define MIN_STEAL_LOG_SIZE 4
+#endif
+
+#ifndef LEAF_DEPTH_WINDOW
+// Conflicts averaged over when estimating how deep dives go
+#define LEAF_DEPTH_WINDOW 16
+#endif
+
+#ifndef STEAL_BACKOFF_MICROSECONDS
+// Wait before retrying a refused random steal, doubled per refusal in a row
+#define STEAL_BACKOFF_MICROSECONDS 20
+#endif
+
+#ifndef STEAL_BACKOFF_MAX_MICROSECONDS
+// Longest wait between random steals
+#define STEAL_BACKOFF_MAX_MICROSECONDS 2000
+#endif
+
+#ifndef STEAL_HOST_ATTEMPTS
+// Refusals in a row from our host before a node-first thief looks further
+#define STEAL_HOST_ATTEMPTS 2
+#endif
+
+#ifndef REMOTE_STEAL_LOG_SIZE
+// Node-first steals from other hosts are declined below an estimated
+// 2^REMOTE_STEAL_LOG_SIZE nodes, as the state crosses the network
+#define REMOTE_STEAL_LOG_SIZE 8
+#endif
+
+#ifndef RECEIVE_SLOTS
+// Receives kept posted, each holding the largest message a rank can be sent
+#define RECEIVE_SLOTS 8
+#endif
+
+#ifndef SEND_SLOTS
+// Sends tracked at once before the slot ring grows
+#define SEND_SLOTS 64
+#endif
+
+#ifndef CLAUSE_BATCH_INTS
+// Learned clauses are broadcast together once their batch reaches this size
+#define CLAUSE_BATCH_INTS 256
+#endif
+
+#ifndef CLAUSE_BATCH_MICROSECONDS
+// or once its oldest clause has waited this long
+#define CLAUSE_BATCH_MICROSECONDS 500
+#endif
+
+#ifndef CLAUSE_SIGNATURE_CACHE
+// Recently seen clauses remembered so duplicates are neither kept nor passed on
+#define CLAUSE_SIGNATURE_CACHE 1024
+#endif
+
+#ifndef CLAUSE_RING_SLOTS
+// Clauses each rank keeps in its window for peers to pull in rma mode
+#define CLAUSE_RING_SLOTS 64
+#endif
+
+#ifndef CLAUSE_PULL_DEPTH
+// Peers' rings are pulled once the search is back within this many levels
+#define CLAUSE_PULL_DEPTH 2
+#endif
+
+#ifndef CLAUSE_PULL_MICROSECONDS
+// and this long has passed since the last pull
+#define CLAUSE_PULL_MICROSECONDS 1000
+#endif
+
+#ifndef SHARED_MEMORY_TRANSPORT
+// Ranks on one host hand over work and clauses through a shared window
+#define SHARED_MEMORY_TRANSPORT 1
+#endif
+
+#ifndef RECEIVE_POOL_BUFFERS
+// Spare receive buffers kept for when work messages take theirs
+#define RECEIVE_POOL_BUFFERS 4
+#endif
+
+#ifndef PROGRESS_THREAD
+// A second thread per rank receives messages and hands them to the solver
+#define PROGRESS_THREAD 0
+#endif
+
+#ifndef PROGRESS_QUEUE_SLOTS
+// Messages either progress thread queue holds, a power of two
+#define PROGRESS_QUEUE_SLOTS 64
+#endif
+
+#ifndef PROGRESS_IDLE_MICROSECONDS
+// How long the progress thread sleeps when it found nothing to do
+#define PROGRESS_IDLE_MICROSECONDS 20
+#endif
+
+// Formula construction control variables
+
+// Adds unit clauses ruling out digits no cage combination can use
+#define CAGE_PRESOLVE 0
+
+// Maps base formulas (no givens or cages) from an on-disk cache
+#define USE_FORMULA_TEMPLATES 1
+
+// Directory of cached base formulas, delete it after changing a reduction
+#define FORMULA_TEMPLATE_DIR "templates"
+
 #ifndef DNDEBUG
 // Production builds should set NDEBUG=1
 #define DNDEBUG false
@@ -80,7 +228,9 @@ struct Message {
     // 3 = work, 
     // 4 = explicit abort
     // 5 = invalidation
-    // 6 = conflict clause
+    // 6 = conflict clauses
+    // 7 = steal refusal, with the refuser's task count
+    // 8 = termination token
     int size;
     void *data;
 };
@@ -151,8 +301,9 @@ bool clause_is_sorted(Clause clause);
 // Returns whether a clause contains a variable, populating the sign if so
 bool variable_in_clause(Clause clause, int var_id, bool *sign);
 
-// Converts a message received to a clause
-Clause message_to_clause(Message message);
+// Converts a batch of clauses received, populating the rank that learned
+// them. The batch is that rank then each clause's length and literals.
+std::vector<Clause> message_to_clauses(Message message, short *origin);
 
 // Makes an assignment ready for a data structure from arguments
 void *make_assignment(int var_id, bool value);
@@ -202,11 +353,31 @@ void raise_error(std::string error_message);
 // Ceiling division
 int ceil_div(int num, int denom);
 
-// Reads 32 bits from bits array as a single signed integer
-unsigned int bits_to_int(bool *bits);
+// Reads 32 bits from bits array as a single unsigned integer
+unsigned int bits_to_int(const bool *bits);
+
+// Writes integer into a 32 bit array
+void int_to_bits(unsigned int value, bool *bits);
+
+// Packs whole bool arrays into words, 32 bools per word
+void pack_bits(const bool *bits, unsigned int *words, int num_words);
+
+// Unpacks words into whole bool arrays, 32 bools per word
+void unpack_bits(const unsigned int *words, bool *bits, int num_words);
 
-// Reads integer into 32 bit array
-bool *int_to_bits(unsigned int value);
+// Ways encode_bitset can write a bitset, kept in its leading byte
+#define BITSET_RAW 0
+#define BITSET_SET_LIST 1
+#define BITSET_CLEAR_LIST 2
+#define BITSET_RUN_LIST 3
+
+// Encodes the first num_bits bits of words as raw words, or as a list of
+// varint gaps between set bits, clear bits or run boundaries, whichever is
+// smallest. Returns the bytes written, at most 1 + 4 * ceil(num_bits / 32).
+int encode_bitset(const unsigned int *words, int num_bits, unsigned char *out);
+
+// Decodes a bitset written by encode_bitset, returns the bytes read
+int decode_bitset(const unsigned char *in, unsigned int *words, int num_bits);
 
 struct LinkedList {
     void *value;
@@ -449,6 +620,33 @@ class Queue {
         void free_data(bool keep_values = false);
 };
 
+// Lock-free queue between exactly one producer and one consumer thread
+class MessageRing {
+    public:
+        Message *slots;
+        unsigned int capacity; // a power of two
+        unsigned int head; // next to pop, written by the consumer
+        unsigned int tail; // next to push, written by the producer
+
+        // Default constructor
+        MessageRing();
+
+        // Allocates room for capacity messages
+        void init(unsigned int capacity);
+
+        // Adds a message at the back, returns false if the ring is full
+        bool push(Message message);
+
+        // Removes the front message, returns false if the ring is empty
+        bool pop(Message &message);
+
+        // Returns whether a push would fail
+        bool full();
+
+        // Frees all data structures
+        void free_ring();
+};
+
 // Gets first task from stack, frees pointer
 Task get_task(Deque &task_stack);
 
@@ -522,28 +720,4 @@ class IntDeque {
         void free_deque();
 };
 
-struct DeadMessageLinkedList {
-  int message_id;
-  void *message;
-  MPI_Request request;
-  DeadMessageLinkedList *next;
-};
-
-class DeadMessageQueue {
-  public:
-    DeadMessageLinkedList *head;
-    DeadMessageLinkedList *tail;
-    int count = 0;
-    int index = 0;
-
-    // Adds value to back of queue
-    void add_to_queue(void *message, MPI_Request request);
-
-    // Pops message value from front of queue
-    void *pop_from_front();
-
-    // Returns the front request without removing it
-    MPI_Request peak_front(int *id_ptr);
-};
-
 #endif
\ No newline at end of file
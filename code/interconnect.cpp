@@ -4,104 +4,979 @@
 #include "helpers.h"
 #include "cnf.h"
 #include <cassert>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
 #include "mpi.h"
 
-Interconnect::Interconnect(int pid, int nproc, int work_bytes) {
+// Control messages carry no data, they all send from here
+static char control_payload;
+
+// Reference count and capacity ahead of a pooled clause payload
+#define CLAUSE_HEADER_BYTES (2 * sizeof(int))
+
+Interconnect::Interconnect(int pid, int nproc) {
   Interconnect::pid = pid;
   Interconnect::nproc = nproc;
-  Interconnect::work_bytes = work_bytes;
-  DeadMessageQueue dead_message_queue;
   Interconnect::stashed_work = (Message *)malloc(sizeof(Message) * nproc);
   Interconnect::work_is_stashed = (bool *)calloc(sizeof(bool), nproc);
   Interconnect::num_stashed_work = 0;
-  Interconnect::dead_message_queue = dead_message_queue;
+  Interconnect::num_send_slots = SEND_SLOTS;
+  Interconnect::send_requests = (MPI_Request *)malloc(sizeof(MPI_Request) * SEND_SLOTS);
+  Interconnect::send_buffers = (void **)malloc(sizeof(void *) * SEND_SLOTS);
+  Interconnect::send_kinds = (char *)malloc(sizeof(char) * SEND_SLOTS);
+  Interconnect::free_send_slots = (int *)malloc(sizeof(int) * SEND_SLOTS);
+  Interconnect::completed_send_slots = (int *)malloc(sizeof(int) * SEND_SLOTS);
+  Interconnect::num_free_send_slots = 0;
+  Interconnect::num_sends_in_flight = 0;
+  Interconnect::clause_batch = NULL;
+  Interconnect::clause_batch_ints = 0;
+  Interconnect::clause_messages_sent = 0;
+  Interconnect::clause_overlay = CLAUSE_OVERLAY_DIRECT;
+  Interconnect::branching_factor = 2;
+  Interconnect::clause_signatures = (uint64_t *)calloc(
+    sizeof(uint64_t), CLAUSE_SIGNATURE_CACHE);
+  Interconnect::clause_ring = NULL;
+  Interconnect::clauses_imported = 0;
+  Interconnect::clauses_pulled = (int *)calloc(sizeof(int), nproc);
+  Interconnect::shared_region = NULL;
+  Interconnect::work_via_shared_memory = 0;
+  Interconnect::last_clause_pull = std::chrono::steady_clock::now();
+  Interconnect::progress_thread = NULL;
+  Interconnect::termination_open = false;
+  Interconnect::solution_broadcast = false;
+  Interconnect::termination_heard = false;
+  Interconnect::search_exhausted = false;
+  Interconnect::quiesce_seconds = -1;
+  for (int slot = SEND_SLOTS - 1; slot >= 0; slot--) {
+    Interconnect::send_requests[slot] = MPI_REQUEST_NULL;
+    Interconnect::send_kinds[slot] = 'n';
+    Interconnect::free_send_slots[Interconnect::num_free_send_slots++] = slot;
+  }
+  Interconnect::receives_posted = false;
+  Interconnect::message_capacity = 0;
+  Interconnect::receive_requests = NULL;
+  Interconnect::receive_buffers = NULL;
+  Interconnect::receive_held = NULL;
+  Interconnect::next_receive_slot = 0;
+}
+
+// Starts the persistent receives, no message may exceed capacity
+void Interconnect::post_receives(int capacity) {
+  if (Interconnect::receives_posted || Interconnect::nproc == 1) {
+    return;
+  }
+  Interconnect::message_capacity = capacity;
+  Interconnect::receive_requests = (MPI_Request *)malloc(
+    sizeof(MPI_Request) * RECEIVE_SLOTS);
+  Interconnect::receive_buffers = (void **)malloc(sizeof(void *) * RECEIVE_SLOTS);
+  Interconnect::receive_held = (bool *)calloc(sizeof(bool), RECEIVE_SLOTS);
+  // Any source and tag so messages still come out in the order they were sent
+  for (short slot = 0; slot < RECEIVE_SLOTS; slot++) {
+    Interconnect::receive_buffers[slot] = malloc(capacity);
+    MPI_Recv_init(Interconnect::receive_buffers[slot], capacity, MPI_CHAR, 
+      MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, 
+      &(Interconnect::receive_requests[slot]));
+  }
+  MPI_Startall(RECEIVE_SLOTS, Interconnect::receive_requests);
+  Interconnect::next_receive_slot = 0;
+  Interconnect::receives_posted = true;
 }
         
 // Receives one async messages, returns false if nothing received
 bool Interconnect::async_receive_message(Message &message) {
-  int buffer_size_needed = 0;
+  if (Interconnect::progress_thread != NULL) {
+    return Interconnect::received_messages.pop(message);
+  }
+  return poll_receive_ring(message);
+}
+
+// Takes the next completed receive off the ring, returns false if there is
+// none. Detached messages leave their slot receiving again at once.
+bool Interconnect::poll_receive_ring(Message &message, bool detach) {
+  if (!Interconnect::receives_posted) {
+    return false;
+  }
+  short slot = Interconnect::next_receive_slot;
+  if (Interconnect::receive_held[slot]) {
+    // Its last message is still being handled
+    return false;
+  }
   MPI_Status status;
   int flag;
-  MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, &status);
+  MPI_Test(&(Interconnect::receive_requests[slot]), &flag, &status);
   if (!flag) {
     return false;
   }
-  MPI_Get_count(&status, MPI_CHAR, &buffer_size_needed);
   int sender = status.MPI_SOURCE;
-  void *buffer = (void *)malloc(buffer_size_needed * sizeof(char));
-  MPI_Recv(buffer, buffer_size_needed, MPI_CHAR, sender, 
-    MPI_ANY_TAG, MPI_COMM_WORLD, &status);
   message.sender = sender;
   message.type = status.MPI_TAG;
-  message.size = buffer_size_needed;
-  message.data = buffer;
+  MPI_Get_count(&status, MPI_CHAR, &(message.size));
+  message.data = Interconnect::receive_buffers[slot];
+  if (message.type == 3 && message.size == 0) {
+    // The work itself is in our mailbox for the sender
+    MPI_Win_sync(Interconnect::shared_window);
+    int *mailbox = work_mailbox(Interconnect::pid, sender);
+    assert(mailbox != NULL && __atomic_load_n(mailbox, __ATOMIC_ACQUIRE) == 1);
+    message.data = acquire_receive_buffer();
+    message.size = mailbox[1];
+    memcpy(message.data, mailbox + 2, message.size);
+    __atomic_store_n(mailbox, 0, __ATOMIC_RELEASE);
+    MPI_Start(&(Interconnect::receive_requests[slot]));
+  } else if (message.type == 3 || detach) {
+    // Work outlives its handler, so the slot gets another buffer. Slots
+    // must restart in ring order to match in it, so a receiver running
+    // ahead of the handlers detaches everything.
+    MPI_Request_free(&(Interconnect::receive_requests[slot]));
+    void *buffer = acquire_receive_buffer();
+    Interconnect::receive_buffers[slot] = buffer;
+    MPI_Recv_init(buffer, Interconnect::message_capacity, MPI_CHAR, 
+      MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, 
+      &(Interconnect::receive_requests[slot]));
+    MPI_Start(&(Interconnect::receive_requests[slot]));
+  } else {
+    // Restarted once the handler releases it
+    Interconnect::receive_held[slot] = true;
+  }
+  Interconnect::next_receive_slot = (slot + 1) % RECEIVE_SLOTS;
   if (PRINT_INTERCONNECT) printf(" I(message type %d [%d -> %d] received)\n", message.type, sender, Interconnect::pid);
   return true;
 }
 
+// Returns a spare receive buffer, recycled when possible
+void *Interconnect::acquire_receive_buffer() {
+  if (Interconnect::buffer_pool.empty()) {
+    return malloc(Interconnect::message_capacity);
+  }
+  void *buffer = Interconnect::buffer_pool.back();
+  Interconnect::buffer_pool.pop_back();
+  return buffer;
+}
+
+// Starts a thread receiving messages for the solver, if PROGRESS_THREAD is
+// set and MPI allows it
+void Interconnect::start_progress_thread() {
+  if (!PROGRESS_THREAD || Interconnect::nproc == 1 || !Interconnect::receives_posted 
+      || Interconnect::progress_thread != NULL) {
+    return;
+  }
+  int thread_level;
+  MPI_Query_thread(&thread_level);
+  if (thread_level != MPI_THREAD_MULTIPLE) {
+    return;
+  }
+  Interconnect::received_messages.init(PROGRESS_QUEUE_SLOTS);
+  Interconnect::released_buffers.init(PROGRESS_QUEUE_SLOTS);
+  Interconnect::progress_thread_stopping = false;
+  Interconnect::progress_thread = new std::thread(&Interconnect::progress_loop, this);
+}
+
+// Receives messages and recycles their buffers until told to stop. Owns the
+// receive ring and buffer pool while it runs.
+void Interconnect::progress_loop() {
+  Message message;
+  while (!__atomic_load_n(&(Interconnect::progress_thread_stopping), __ATOMIC_ACQUIRE)) {
+    bool progressed = false;
+    while (Interconnect::released_buffers.pop(message)) {
+      recycle_buffer(message.data);
+      progressed = true;
+    }
+    while (!Interconnect::received_messages.full() && poll_receive_ring(message, true)) {
+      Interconnect::received_messages.push(message);
+      progressed = true;
+    }
+    if (!progressed) {
+      std::this_thread::sleep_for(std::chrono::microseconds(PROGRESS_IDLE_MICROSECONDS));
+    }
+  }
+}
+
+// Joins the progress thread, dropping messages it had not handed over
+void Interconnect::stop_progress_thread() {
+  if (Interconnect::progress_thread == NULL) {
+    return;
+  }
+  __atomic_store_n(&(Interconnect::progress_thread_stopping), true, __ATOMIC_RELEASE);
+  Interconnect::progress_thread->join();
+  delete Interconnect::progress_thread;
+  Interconnect::progress_thread = NULL;
+  Message message;
+  while (Interconnect::released_buffers.pop(message)) {
+    recycle_buffer(message.data);
+  }
+  while (Interconnect::received_messages.pop(message)) {
+    recycle_buffer(message.data);
+  }
+  Interconnect::received_messages.free_ring();
+  Interconnect::released_buffers.free_ring();
+}
+
+// Returns a received message's data for reuse
+void Interconnect::release_buffer(void *buffer) {
+  if (Interconnect::progress_thread != NULL) {
+    // The receive ring is the progress thread's to touch
+    Message released;
+    released.data = buffer;
+    while (!Interconnect::released_buffers.push(released)) {
+      std::this_thread::yield();
+    }
+    return;
+  }
+  recycle_buffer(buffer);
+}
+
+// Restarts the receive slot a buffer belongs to or pools it
+void Interconnect::recycle_buffer(void *buffer) {
+  if (!Interconnect::receives_posted) {
+    free(buffer);
+    return;
+  }
+  for (short slot = 0; slot < RECEIVE_SLOTS; slot++) {
+    if (Interconnect::receive_buffers[slot] == buffer) {
+      assert(Interconnect::receive_held[slot]);
+      Interconnect::receive_held[slot] = false;
+      MPI_Start(&(Interconnect::receive_requests[slot]));
+      return;
+    }
+  }
+  if (Interconnect::buffer_pool.size() < RECEIVE_POOL_BUFFERS) {
+    Interconnect::buffer_pool.push_back(buffer);
+  } else {
+    free(buffer);
+  }
+}
+
+// Takes a free send slot, adding slots when every one is in flight
+int Interconnect::claim_send_slot() {
+  if (Interconnect::num_free_send_slots == 0) {
+    clean_dead_messages();
+  }
+  if (Interconnect::num_free_send_slots == 0) {
+    // Sends to a finished rank never complete, so waiting on one could hang
+    int old_slots = Interconnect::num_send_slots;
+    Interconnect::num_send_slots *= 2;
+    int num_slots = Interconnect::num_send_slots;
+    Interconnect::send_requests = (MPI_Request *)realloc(
+      Interconnect::send_requests, sizeof(MPI_Request) * num_slots);
+    Interconnect::send_buffers = (void **)realloc(
+      Interconnect::send_buffers, sizeof(void *) * num_slots);
+    Interconnect::send_kinds = (char *)realloc(
+      Interconnect::send_kinds, sizeof(char) * num_slots);
+    Interconnect::free_send_slots = (int *)realloc(
+      Interconnect::free_send_slots, sizeof(int) * num_slots);
+    Interconnect::completed_send_slots = (int *)realloc(
+      Interconnect::completed_send_slots, sizeof(int) * num_slots);
+    for (int slot = num_slots - 1; slot >= old_slots; slot--) {
+      Interconnect::send_requests[slot] = MPI_REQUEST_NULL;
+      Interconnect::send_kinds[slot] = 'n';
+      Interconnect::free_send_slots[Interconnect::num_free_send_slots++] = slot;
+    }
+  }
+  return Interconnect::free_send_slots[--Interconnect::num_free_send_slots];
+}
+
+// Sends data from a slot, kind says how data is released once delivered
+void Interconnect::start_send(
+    void *data, 
+    int num_bytes, 
+    short recipient, 
+    short type, 
+    char kind, 
+    void *buffer) {
+  int slot = claim_send_slot();
+  MPI_Isend(data, num_bytes, MPI_CHAR, recipient, type, 
+    MPI_COMM_WORLD, &(Interconnect::send_requests[slot]));
+  Interconnect::send_buffers[slot] = buffer;
+  Interconnect::send_kinds[slot] = kind;
+  Interconnect::num_sends_in_flight++;
+  if (PRINT_INTERCONNECT) printf(" I(message type %d [%d -> %d] sent) (slot = %d)\n", type, Interconnect::pid, recipient, slot);
+}
+
 // Sends message asking for work
 void Interconnect::send_work_request(short recipient, short version) {
-  MPI_Request request;
-  void *data = (void *)malloc(sizeof(char));
-  MPI_Isend(data, 1, MPI_CHAR, recipient, version, MPI_COMM_WORLD, &request);
-  if (PRINT_INTERCONNECT) printf(" I(message type %d [%d -> %d] sent) (id = %d)\n", version, Interconnect::pid, recipient, Interconnect::dead_message_queue.index);
-  Interconnect::dead_message_queue.add_to_queue(data, request);
+  start_send(&control_payload, 0, recipient, version, 'n', NULL);
 }
 
 // Sends work message
-void Interconnect::send_work(short recipient, void *work) {
-  MPI_Request request;
-  MPI_Isend(work, Interconnect::work_bytes, MPI_CHAR, recipient, 3, 
-    MPI_COMM_WORLD, &request);
-  if (PRINT_INTERCONNECT) printf(" I(message type 3 [%d -> %d] sent) (id = %d)\n", Interconnect::pid, recipient, Interconnect::dead_message_queue.index);
-  Interconnect::dead_message_queue.add_to_queue(work, request);
+void Interconnect::send_work(short recipient, void *work, int num_bytes) {
+  assert(num_bytes <= Interconnect::message_capacity || !Interconnect::receives_posted);
+  int *mailbox = work_mailbox(recipient, Interconnect::pid);
+  if (mailbox != NULL && num_bytes <= (int)sizeof(int) * (Interconnect::mailbox_ints - 2) 
+      && __atomic_load_n(mailbox, __ATOMIC_ACQUIRE) == 0) {
+    memcpy(mailbox + 2, work, num_bytes);
+    mailbox[1] = num_bytes;
+    __atomic_store_n(mailbox, 1, __ATOMIC_RELEASE);
+    MPI_Win_sync(Interconnect::shared_window);
+    free(work);
+    // An empty work message keeps it in order with the rest of our messages
+    start_send(&control_payload, 0, recipient, 3, 'n', NULL);
+    Interconnect::work_via_shared_memory++;
+    return;
+  }
+  start_send(work, num_bytes, recipient, 3, 'f', work);
 }
 
 // Sends an abort message
 void Interconnect::send_abort_message(short recipient) {
-  MPI_Request request;
-  void *data = (void *)malloc(sizeof(char));
-  MPI_Isend(data, 1, MPI_CHAR, recipient, 4, MPI_COMM_WORLD, &request);
-  if (PRINT_INTERCONNECT) printf(" I(message type 4 [%d -> %d] sent) (id = %d)\n", Interconnect::pid, recipient, Interconnect::dead_message_queue.index);
-  Interconnect::dead_message_queue.add_to_queue(data, request);
+  start_send(&control_payload, 0, recipient, 4, 'n', NULL);
+}
+
+// Tells a rank that asked for work that we have none to spare, and how many
+// tasks we hold
+void Interconnect::send_steal_refusal(short recipient, int load) {
+  int *payload = (int *)malloc(sizeof(int));
+  payload[0] = load;
+  start_send(payload, sizeof(int), recipient, 7, 'f', payload);
+}
+
+// Passes the termination token on with the work messages counted sent less
+// received so far, and whether any rank it passed received work
+void Interconnect::send_termination_token(short recipient, int count, bool touched) {
+  int *payload = (int *)malloc(sizeof(int) * 2);
+  payload[0] = count;
+  payload[1] = touched;
+  start_send(payload, sizeof(int) * 2, recipient, 8, 'f', payload);
+}
+
+// Posts a broadcast from every other rank, the first to find a solution
+// completes its own. Collective.
+void Interconnect::open_termination() {
+  if (Interconnect::nproc == 1 || Interconnect::termination_open) {
+    return;
+  }
+  int nproc = Interconnect::nproc;
+  Interconnect::termination_comms = (MPI_Comm *)malloc(sizeof(MPI_Comm) * nproc);
+  Interconnect::termination_requests = (MPI_Request *)malloc(sizeof(MPI_Request) * nproc);
+  Interconnect::termination_winners = (int *)malloc(sizeof(int) * nproc);
+  Interconnect::termination_indices = (int *)malloc(sizeof(int) * nproc);
+  for (short root = 0; root < nproc; root++) {
+    // A communicator each, so roots need not broadcast in rank order
+    MPI_Comm_dup(MPI_COMM_WORLD, &(Interconnect::termination_comms[root]));
+    if (root == Interconnect::pid) {
+      Interconnect::termination_requests[root] = MPI_REQUEST_NULL;
+    } else {
+      MPI_Ibcast(&(Interconnect::termination_winners[root]), 1, MPI_INT, root, 
+        Interconnect::termination_comms[root], &(Interconnect::termination_requests[root]));
+    }
+  }
+  Interconnect::solution_broadcast = false;
+  Interconnect::termination_heard = false;
+  Interconnect::termination_open = true;
+}
+
+// Starts our own termination broadcast
+static void broadcast_outcome(Interconnect &interconnect, int outcome) {
+  short pid = interconnect.pid;
+  interconnect.termination_winners[pid] = outcome;
+  MPI_Ibcast(&(interconnect.termination_winners[pid]), 1, MPI_INT, pid, 
+    interconnect.termination_comms[pid], &(interconnect.termination_requests[pid]));
+  interconnect.solution_broadcast = true;
+}
+
+// Broadcasts that we found a solution
+void Interconnect::announce_solution() {
+  if (!Interconnect::termination_open || Interconnect::solution_broadcast) {
+    return;
+  }
+  Interconnect::solution_found_at = std::chrono::steady_clock::now();
+  broadcast_outcome(*this, Interconnect::pid);
+}
+
+// Broadcasts that no rank can find a solution
+void Interconnect::announce_exhaustion() {
+  Interconnect::search_exhausted = true;
+  if (!Interconnect::termination_open || Interconnect::solution_broadcast) {
+    return;
+  }
+  broadcast_outcome(*this, TERMINATION_EXHAUSTED);
+}
+
+// Returns whether another rank has broadcast a solution or exhaustion
+bool Interconnect::termination_announced() {
+  if (!Interconnect::termination_open || Interconnect::termination_heard) {
+    return Interconnect::termination_heard;
+  }
+  int num_completed;
+  MPI_Testsome(Interconnect::nproc, Interconnect::termination_requests, &num_completed, 
+    Interconnect::termination_indices, MPI_STATUSES_IGNORE);
+  if (num_completed == MPI_UNDEFINED) {
+    return false;
+  }
+  for (int i = 0; i < num_completed; i++) {
+    short root = Interconnect::termination_indices[i];
+    int outcome = Interconnect::termination_winners[root];
+    if (root == Interconnect::pid || outcome == TERMINATION_QUIET) {
+      continue;
+    }
+    Interconnect::termination_heard = true;
+    Interconnect::search_exhausted |= (outcome == TERMINATION_EXHAUSTED);
+  }
+  return Interconnect::termination_heard;
+}
+
+// Broadcasts that we found nothing unless we already announced, then
+// discards arrivals until our sends are delivered and every rank has done
+// the same. Collective.
+void Interconnect::quiesce() {
+  if (!Interconnect::termination_open) {
+    return;
+  }
+  short pid = Interconnect::pid;
+  if (!Interconnect::solution_broadcast) {
+    broadcast_outcome(*this, TERMINATION_QUIET);
+  }
+  // Entered once our sends are out, so it completes with nothing in flight
+  MPI_Request barrier = MPI_REQUEST_NULL;
+  int quiet = 0;
+  Message message;
+  while (!quiet) {
+    while (poll_receive_ring(message)) {
+      release_buffer(message.data);
+    }
+    if (barrier == MPI_REQUEST_NULL) {
+      clean_dead_messages();
+      if (Interconnect::num_sends_in_flight == 0) {
+        MPI_Ibarrier(Interconnect::termination_comms[0], &barrier);
+      }
+    } else {
+      MPI_Test(&barrier, &quiet, MPI_STATUS_IGNORE);
+    }
+  }
+  MPI_Waitall(Interconnect::nproc, Interconnect::termination_requests, MPI_STATUSES_IGNORE);
+  if (Interconnect::termination_winners[pid] == pid) {
+    Interconnect::quiesce_seconds = std::chrono::duration_cast<std::chrono::duration<double>>(
+      std::chrono::steady_clock::now() - Interconnect::solution_found_at).count();
+  }
+  for (short root = 0; root < Interconnect::nproc; root++) {
+    MPI_Comm_free(&(Interconnect::termination_comms[root]));
+  }
+  free(Interconnect::termination_comms);
+  free(Interconnect::termination_requests);
+  free(Interconnect::termination_winners);
+  free(Interconnect::termination_indices);
+  Interconnect::termination_open = false;
 }
 
 // Sends an invalidation message
 void Interconnect::send_invalidation(short recipient) {
-  MPI_Request request;
-  void *data = (void *)malloc(sizeof(char));
-  MPI_Isend(data, 1, MPI_CHAR, recipient, 5, MPI_COMM_WORLD, &request);
-  if (PRINT_INTERCONNECT) printf(" I(message type 5 [%d -> %d] sent) (id = %d)\n", Interconnect::pid, recipient, Interconnect::dead_message_queue.index);
-  Interconnect::dead_message_queue.add_to_queue(data, request);
+  start_send(&control_payload, 0, recipient, 5, 'n', NULL);
 }
 
-// Sends a conflict clause to a recipient
-void Interconnect::send_conflict_clause(
-    short recipient, 
-    Clause conflict_clause,
-    bool broadcast) {
-  if (broadcast) {
-    for (short i = 0; i < Interconnect::nproc; i++) {
-      if (i == Interconnect::pid) {
+// Returns a pooled clause buffer with room for num_bytes of clauses
+int *Interconnect::acquire_clause_buffer(int num_bytes) {
+  // Pooled clause buffers lead with a reference count and their capacity
+  int *buffer;
+  if (Interconnect::clause_pool.empty()) {
+    buffer = (int *)malloc(CLAUSE_HEADER_BYTES + num_bytes);
+    buffer[1] = num_bytes;
+  } else {
+    buffer = Interconnect::clause_pool.back();
+    Interconnect::clause_pool.pop_back();
+    if (buffer[1] < num_bytes) {
+      buffer = (int *)realloc(buffer, CLAUSE_HEADER_BYTES + num_bytes);
+      buffer[1] = num_bytes;
+    }
+  }
+  return buffer;
+}
+
+// Sends the clauses in a pooled buffer to each recipient. The buffer
+// returns to the pool once delivered.
+void Interconnect::send_clause_buffer(
+    int *buffer, 
+    int num_bytes, 
+    std::vector<short> &recipients) {
+  assert(num_bytes <= Interconnect::message_capacity || !Interconnect::receives_posted);
+  // Every recipient shares the one buffer
+  buffer[0] = recipients.size();
+  if (buffer[0] == 0) {
+    Interconnect::clause_pool.push_back(buffer);
+    return;
+  }
+  void *data = (void *)((char *)buffer + CLAUSE_HEADER_BYTES);
+  for (short recipient : recipients) {
+    start_send(data, num_bytes, recipient, 6, 'c', buffer);
+  }
+  Interconnect::clause_messages_sent += recipients.size();
+}
+
+// Writes a clause as its length then signed 1-indexed literals, returns
+// the ints written
+static int write_clause(Clause clause, int *destination) {
+  destination[0] = clause.num_literals;
+  for (int i = 0; i < clause.num_literals; i++) {
+    int literal = clause.literal_variable_ids[i] + 1;
+    destination[i + 1] = clause.literal_signs[i] ? literal : -literal;
+  }
+  return clause.num_literals + 1;
+}
+
+// Returns a copy of a clause written by write_clause
+static Clause read_clause(int *source) {
+  Clause clause;
+  clause.num_literals = source[0];
+  clause.literal_signs = (bool *)malloc(sizeof(bool) * clause.num_literals);
+  clause.literal_variable_ids = (int *)malloc(sizeof(int) * clause.num_literals);
+  for (int i = 0; i < clause.num_literals; i++) {
+    int literal = source[i + 1];
+    clause.literal_signs[i] = literal > 0;
+    clause.literal_variable_ids[i] = (literal > 0 ? literal : -literal) - 1;
+  }
+  return clause;
+}
+
+// Sends a conflict clause to a recipient right away
+void Interconnect::send_conflict_clause(short recipient, Clause conflict_clause) {
+  int num_bytes = sizeof(int) * (conflict_clause.num_literals + 2);
+  int *buffer = acquire_clause_buffer(num_bytes);
+  int *batch = (int *)((char *)buffer + CLAUSE_HEADER_BYTES);
+  // No origin, so the recipient keeps it to itself
+  batch[0] = -1;
+  write_clause(conflict_clause, batch + 1);
+  std::vector<short> recipients = {recipient};
+  send_clause_buffer(buffer, num_bytes, recipients);
+}
+
+// Adds a conflict clause to the batch for every other rank, flushing it
+// first if the clause would overfill it
+void Interconnect::queue_conflict_clause(Clause conflict_clause) {
+  if (Interconnect::nproc == 1 || clause_seen(conflict_clause)) {
+    return;
+  }
+  if (Interconnect::clause_ring != NULL) {
+    // Peers pull it whenever suits them
+    publish_conflict_clause(conflict_clause);
+    return;
+  }
+  if (shares_clause_ring(Interconnect::pid)) {
+    // Ranks on our host pull it, the batch is only for the others
+    publish_shared_conflict_clause(conflict_clause);
+    if (Interconnect::num_off_node_ranks == 0) {
+      return;
+    }
+  }
+  int clause_ints = conflict_clause.num_literals + 1;
+  if (Interconnect::clause_batch_ints + clause_ints > CLAUSE_BATCH_INTS) {
+    flush_conflict_clauses(true);
+  }
+  if (Interconnect::clause_batch == NULL) {
+    Interconnect::clause_batch = acquire_clause_buffer(
+      sizeof(int) * std::max(CLAUSE_BATCH_INTS, clause_ints + 1));
+    Interconnect::clause_batch_started = std::chrono::steady_clock::now();
+    // Batches start with the rank that learned their clauses
+    int *batch = (int *)((char *)Interconnect::clause_batch + CLAUSE_HEADER_BYTES);
+    batch[0] = Interconnect::pid;
+    Interconnect::clause_batch_ints = 1;
+  }
+  int *batch = (int *)((char *)Interconnect::clause_batch + CLAUSE_HEADER_BYTES);
+  Interconnect::clause_batch_ints += write_clause(
+    conflict_clause, batch + Interconnect::clause_batch_ints);
+}
+
+// Broadcasts the batched conflict clauses if forced or once the oldest has
+// waited CLAUSE_BATCH_MICROSECONDS
+void Interconnect::flush_conflict_clauses(bool force) {
+  if (Interconnect::clause_batch == NULL) {
+    return;
+  }
+  if (!force && std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - Interconnect::clause_batch_started).count() 
+      < CLAUSE_BATCH_MICROSECONDS) {
+    return;
+  }
+  std::vector<short> recipients;
+  overlay_next_hops(Interconnect::pid, -1, recipients);
+  send_clause_buffer(Interconnect::clause_batch, 
+    sizeof(int) * Interconnect::clause_batch_ints, recipients);
+  Interconnect::clause_batch = NULL;
+  Interconnect::clause_batch_ints = 0;
+}
+
+// Returns the clause overlay named, or -1 if there is none by that name
+short clause_overlay_from_name(std::string name) {
+  if (name == "direct") return CLAUSE_OVERLAY_DIRECT;
+  if (name == "tree") return CLAUSE_OVERLAY_TREE;
+  if (name == "hypercube") return CLAUSE_OVERLAY_HYPERCUBE;
+  if (name == "ring") return CLAUSE_OVERLAY_RING;
+  if (name == "rma") return CLAUSE_OVERLAY_RMA;
+  return -1;
+}
+
+// Picks how learned clauses travel between ranks, the tree overlay
+// follows the work tree of the given branching factor
+void Interconnect::set_clause_overlay(short overlay, short branching_factor) {
+  Interconnect::clause_overlay = overlay;
+  Interconnect::branching_factor = branching_factor;
+}
+
+// Collects the ranks clauses learned by origin go on to from here, given
+// the rank they came from (-1 if they are ours)
+void Interconnect::overlay_next_hops(
+    short origin, 
+    short sender, 
+    std::vector<short> &hops) {
+  short pid = Interconnect::pid;
+  short nproc = Interconnect::nproc;
+  switch (Interconnect::clause_overlay) {
+    case CLAUSE_OVERLAY_TREE: {
+      // Acyclic, so passing on to everyone but the sender reaches each once
+      short parent = (pid - 1) / Interconnect::branching_factor;
+      if (pid != 0 && parent != sender) {
+        hops.push_back(parent);
+      }
+      for (short child = 1; child <= Interconnect::branching_factor; child++) {
+        short child_pid = pid * Interconnect::branching_factor + child;
+        if (child_pid < nproc && child_pid != sender) {
+          hops.push_back(child_pid);
+        }
+      }
+      return;
+    } case CLAUSE_OVERLAY_HYPERCUBE: {
+      // Binomial tree rooted at the origin: relative rank r came from r
+      // less its top bit and goes on to r + 2^k for every 2^k > r
+      short relative = (pid - origin + nproc) % nproc;
+      for (int step = 1; relative + step < nproc; step <<= 1) {
+        if (step > relative) {
+          hops.push_back((pid + step) % nproc);
+        }
+      }
+      return;
+    } case CLAUSE_OVERLAY_RING: {
+      short next = (pid + 1) % nproc;
+      if (next != origin) {
+        hops.push_back(next);
+      }
+      return;
+    } default: {
+      if (origin == pid) {
+        for (short i = 0; i < nproc; i++) {
+          if (i != pid && !shares_clause_ring(i)) {
+            hops.push_back(i);
+          }
+        }
+      }
+      return;
+    }
+  }
+}
+
+// Returns whether a clause was seen recently, remembering it if not
+bool Interconnect::clause_seen(Clause clause) {
+  uint64_t signature = 14695981039346656037ull;
+  for (int i = 0; i < clause.num_literals; i++) {
+    uint64_t literal = 2 * (uint64_t)clause.literal_variable_ids[i] + clause.literal_signs[i];
+    signature = (signature ^ literal) * 1099511628211ull;
+  }
+  signature |= 1; // zero marks an empty entry
+  uint64_t &entry = Interconnect::clause_signatures[signature % CLAUSE_SIGNATURE_CACHE];
+  if (entry == signature) {
+    return true;
+  }
+  entry = signature;
+  return false;
+}
+
+// Opens the clause ring window of every rank in rma mode. Collective.
+void Interconnect::open_clause_window(int max_clause_literals) {
+  if (Interconnect::clause_overlay != CLAUSE_OVERLAY_RMA 
+      || Interconnect::nproc == 1 || Interconnect::clause_ring != NULL) {
+    return;
+  }
+  Interconnect::clause_ring_slot_ints = max_clause_literals + 2;
+  int ring_ints = 1 + CLAUSE_RING_SLOTS * Interconnect::clause_ring_slot_ints;
+  MPI_Win_allocate(sizeof(int) * ring_ints, sizeof(int), MPI_INFO_NULL, 
+    MPI_COMM_WORLD, &(Interconnect::clause_ring), &(Interconnect::clause_window));
+  MPI_Win_lock(MPI_LOCK_EXCLUSIVE, Interconnect::pid, 0, Interconnect::clause_window);
+  memset(Interconnect::clause_ring, 0, sizeof(int) * ring_ints);
+  MPI_Win_unlock(Interconnect::pid, Interconnect::clause_window);
+  Interconnect::peer_clause_ring = (int *)malloc(sizeof(int) * ring_ints);
+  // No rank may pull before every ring is cleared
+  MPI_Barrier(MPI_COMM_WORLD);
+}
+
+// Frees the clause ring window. Collective, so only once every rank has
+// finished searching.
+void Interconnect::close_clause_window() {
+  if (Interconnect::clause_ring == NULL) {
+    return;
+  }
+  MPI_Win_free(&(Interconnect::clause_window));
+  Interconnect::clause_ring = NULL;
+  free(Interconnect::peer_clause_ring);
+}
+
+// Finds which ranks run on our host. Collective.
+void Interconnect::discover_topology() {
+  if (Interconnect::nproc == 1 || !Interconnect::on_our_host.empty()) {
+    return;
+  }
+  MPI_Comm host_comm;
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, Interconnect::pid, 
+    MPI_INFO_NULL, &host_comm);
+  int host_size;
+  MPI_Comm_size(host_comm, &host_size);
+  std::vector<int> host_ranks(host_size);
+  MPI_Allgather(&(Interconnect::pid), 1, MPI_INT, host_ranks.data(), 1, MPI_INT, host_comm);
+  MPI_Comm_free(&host_comm);
+  Interconnect::on_our_host.assign(Interconnect::nproc, false);
+  for (int rank : host_ranks) {
+    Interconnect::on_our_host[rank] = true;
+  }
+  for (short rank = 0; rank < Interconnect::nproc; rank++) {
+    if (rank == Interconnect::pid) {
+      continue;
+    }
+    if (Interconnect::on_our_host[rank]) {
+      Interconnect::host_peers.push_back(rank);
+    } else {
+      Interconnect::other_host_ranks.push_back(rank);
+    }
+  }
+}
+
+// Returns whether a rank runs on our host
+bool Interconnect::shares_host(short rank) {
+  return Interconnect::on_our_host.empty() || Interconnect::on_our_host[rank];
+}
+
+// Maps the work mailboxes and clause rings of every rank on our host.
+// Collective.
+void Interconnect::open_shared_memory(int max_clause_literals) {
+  if (!SHARED_MEMORY_TRANSPORT || Interconnect::nproc == 1 
+      || Interconnect::shared_region != NULL) {
+    return;
+  }
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, Interconnect::pid, 
+    MPI_INFO_NULL, &(Interconnect::node_comm));
+  int node_size;
+  MPI_Comm_size(Interconnect::node_comm, &node_size);
+  if (node_size == 1) {
+    MPI_Comm_free(&(Interconnect::node_comm));
+    return;
+  }
+  // Our clause ring, then a work mailbox for each work tree neighbour
+  Interconnect::clause_ring_slot_ints = max_clause_literals + 2;
+  Interconnect::shared_ring_ints = 1 + CLAUSE_RING_SLOTS * Interconnect::clause_ring_slot_ints;
+  Interconnect::mailbox_ints = 2 + ceil_div(Interconnect::message_capacity, sizeof(int));
+  int region_ints = Interconnect::shared_ring_ints 
+    + (Interconnect::branching_factor + 1) * Interconnect::mailbox_ints;
+  MPI_Win_allocate_shared(sizeof(int) * region_ints, sizeof(int), MPI_INFO_NULL, 
+    Interconnect::node_comm, &(Interconnect::shared_region), &(Interconnect::shared_window));
+  memset(Interconnect::shared_region, 0, sizeof(int) * region_ints);
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, Interconnect::shared_window);
+
+  MPI_Group world_group;
+  MPI_Group node_group;
+  MPI_Comm_group(MPI_COMM_WORLD, &world_group);
+  MPI_Comm_group(Interconnect::node_comm, &node_group);
+  std::vector<int> node_ranks(node_size);
+  std::vector<int> world_ranks(node_size);
+  for (int i = 0; i < node_size; i++) {
+    node_ranks[i] = i;
+  }
+  MPI_Group_translate_ranks(node_group, node_size, node_ranks.data(), 
+    world_group, world_ranks.data());
+  MPI_Group_free(&world_group);
+  MPI_Group_free(&node_group);
+  Interconnect::peer_regions = (int **)calloc(sizeof(int *), Interconnect::nproc);
+  for (int i = 0; i < node_size; i++) {
+    MPI_Aint region_bytes;
+    int displacement_unit;
+    MPI_Win_shared_query(Interconnect::shared_window, i, &region_bytes, 
+      &displacement_unit, &(Interconnect::peer_regions[world_ranks[i]]));
+  }
+  Interconnect::num_off_node_ranks = Interconnect::nproc - node_size;
+  // No rank may use a region before its owner has cleared it
+  MPI_Win_sync(Interconnect::shared_window);
+  MPI_Barrier(Interconnect::node_comm);
+  MPI_Win_sync(Interconnect::shared_window);
+}
+
+// Unmaps the shared regions. Collective, so only once every rank has
+// finished searching.
+void Interconnect::close_shared_memory() {
+  if (Interconnect::shared_region == NULL) {
+    return;
+  }
+  MPI_Win_unlock_all(Interconnect::shared_window);
+  MPI_Win_free(&(Interconnect::shared_window));
+  MPI_Comm_free(&(Interconnect::node_comm));
+  free(Interconnect::peer_regions);
+  Interconnect::shared_region = NULL;
+}
+
+// Returns sender's work mailbox in receiver's region, NULL unless the two
+// share our host and are work tree neighbours
+int *Interconnect::work_mailbox(short receiver, short sender) {
+  if (Interconnect::shared_region == NULL 
+      || Interconnect::peer_regions[receiver] == NULL) {
+    return NULL;
+  }
+  short branching_factor = Interconnect::branching_factor;
+  short index = sender - receiver * branching_factor - 1;
+  if (receiver != 0 && sender == (receiver - 1) / branching_factor) {
+    index = branching_factor;
+  } else if (index < 0 || index >= branching_factor) {
+    return NULL;
+  }
+  return Interconnect::peer_regions[receiver] + Interconnect::shared_ring_ints 
+    + index * Interconnect::mailbox_ints;
+}
+
+// Returns whether clauses reach a rank through its shared clause ring
+// rather than messages
+bool Interconnect::shares_clause_ring(short rank) {
+  return Interconnect::shared_region != NULL 
+    && Interconnect::clause_overlay == CLAUSE_OVERLAY_DIRECT 
+    && Interconnect::peer_regions[rank] != NULL;
+}
+
+// Adds a clause to our shared clause ring, overwriting the oldest
+void Interconnect::publish_shared_conflict_clause(Clause conflict_clause) {
+  assert(conflict_clause.num_literals + 2 <= Interconnect::clause_ring_slot_ints);
+  int *ring = Interconnect::shared_region;
+  int sequence = ring[0];
+  int *slot = ring + 1 + (sequence % CLAUSE_RING_SLOTS) * Interconnect::clause_ring_slot_ints;
+  // Readers drop a slot whose sequence number changed while they copied it
+  __atomic_store_n(slot, -1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  write_clause(conflict_clause, slot + 1);
+  __atomic_store_n(slot, sequence, __ATOMIC_RELEASE);
+  __atomic_store_n(ring, sequence + 1, __ATOMIC_RELEASE);
+}
+
+// Copies out the clauses published to shared rings since the last pull
+void Interconnect::pull_shared_conflict_clauses(std::vector<Clause> &clauses) {
+  int slot_ints = Interconnect::clause_ring_slot_ints;
+  std::vector<int> copy(slot_ints);
+  for (short peer = 0; peer < Interconnect::nproc; peer++) {
+    if (peer == Interconnect::pid || !shares_clause_ring(peer)) {
+      continue;
+    }
+    int *ring = Interconnect::peer_regions[peer];
+    int published = __atomic_load_n(ring, __ATOMIC_ACQUIRE);
+    int first = std::max(Interconnect::clauses_pulled[peer], published - CLAUSE_RING_SLOTS);
+    for (int sequence = first; sequence < published; sequence++) {
+      int *slot = ring + 1 + (sequence % CLAUSE_RING_SLOTS) * slot_ints;
+      if (__atomic_load_n(slot, __ATOMIC_ACQUIRE) != sequence) {
+        continue; // already overwritten
+      }
+      int num_literals = slot[1];
+      if (num_literals < 0 || num_literals + 2 > slot_ints) {
         continue;
       }
-      send_conflict_clause(i, conflict_clause);
+      memcpy(copy.data(), slot + 1, sizeof(int) * (num_literals + 1));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(slot, __ATOMIC_RELAXED) != sequence) {
+        continue;
+      }
+      clauses.push_back(read_clause(copy.data()));
+      Interconnect::clauses_imported++;
+    }
+    Interconnect::clauses_pulled[peer] = published;
+  }
+}
+
+// Returns whether this rank pulls clauses at safe points rather than
+// having them all sent
+bool Interconnect::pulls_clauses() {
+  return Interconnect::clause_ring != NULL 
+    || (Interconnect::shared_region != NULL 
+      && Interconnect::clause_overlay == CLAUSE_OVERLAY_DIRECT);
+}
+
+// Adds a clause to our ring, overwriting the oldest
+void Interconnect::publish_conflict_clause(Clause conflict_clause) {
+  assert(conflict_clause.num_literals + 2 <= Interconnect::clause_ring_slot_ints);
+  MPI_Win_lock(MPI_LOCK_EXCLUSIVE, Interconnect::pid, 0, Interconnect::clause_window);
+  int sequence = Interconnect::clause_ring[0];
+  int *slot = Interconnect::clause_ring + 1 
+    + (sequence % CLAUSE_RING_SLOTS) * Interconnect::clause_ring_slot_ints;
+  slot[0] = sequence;
+  write_clause(conflict_clause, slot + 1);
+  Interconnect::clause_ring[0] = sequence + 1;
+  MPI_Win_unlock(Interconnect::pid, Interconnect::clause_window);
+}
+
+// Returns whether CLAUSE_PULL_MICROSECONDS have passed since the last pull
+bool Interconnect::clause_pull_due() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - Interconnect::last_clause_pull).count() 
+    >= CLAUSE_PULL_MICROSECONDS;
+}
+
+// Copies out the clauses peers have published since the last pull
+void Interconnect::pull_conflict_clauses(std::vector<Clause> &clauses) {
+  Interconnect::last_clause_pull = std::chrono::steady_clock::now();
+  if (Interconnect::shared_region != NULL 
+      && Interconnect::clause_overlay == CLAUSE_OVERLAY_DIRECT) {
+    pull_shared_conflict_clauses(clauses);
+  }
+  if (Interconnect::clause_ring == NULL) {
+    return;
+  }
+  int slot_ints = Interconnect::clause_ring_slot_ints;
+  int *ring = Interconnect::peer_clause_ring;
+  for (short peer = 0; peer < Interconnect::nproc; peer++) {
+    if (peer == Interconnect::pid) {
+      continue;
+    }
+    MPI_Win_lock(MPI_LOCK_SHARED, peer, 0, Interconnect::clause_window);
+    MPI_Get(ring, 1, MPI_INT, peer, 0, 1, MPI_INT, Interconnect::clause_window);
+    MPI_Win_flush(peer, Interconnect::clause_window);
+    int published = ring[0];
+    int first = std::max(Interconnect::clauses_pulled[peer], published - CLAUSE_RING_SLOTS);
+    if (first < published) {
+      // Only the slots written since, they may wrap around the ring
+      int num_new = published - first;
+      int start_slot = first % CLAUSE_RING_SLOTS;
+      int num_before_wrap = std::min(num_new, CLAUSE_RING_SLOTS - start_slot);
+      MPI_Get(ring + 1 + start_slot * slot_ints, num_before_wrap * slot_ints, MPI_INT, 
+        peer, 1 + start_slot * slot_ints, num_before_wrap * slot_ints, MPI_INT, 
+        Interconnect::clause_window);
+      if (num_new > num_before_wrap) {
+        MPI_Get(ring + 1, (num_new - num_before_wrap) * slot_ints, MPI_INT, 
+          peer, 1, (num_new - num_before_wrap) * slot_ints, MPI_INT, 
+          Interconnect::clause_window);
+      }
+    }
+    MPI_Win_unlock(peer, Interconnect::clause_window);
+    for (int sequence = first; sequence < published; sequence++) {
+      int *slot = ring + 1 + (sequence % CLAUSE_RING_SLOTS) * slot_ints;
+      assert(slot[0] == sequence);
+      clauses.push_back(read_clause(slot + 1));
     }
+    Interconnect::clauses_imported += published - first;
+    Interconnect::clauses_pulled[peer] = published;
+  }
+}
+
+// Passes clauses received from sender on along the overlay
+void Interconnect::forward_conflict_clauses(
+    std::vector<Clause> &clauses, 
+    short origin, 
+    short sender) {
+  if (origin == -1 || clauses.empty()) {
     return;
   }
-  size_t buffer_size = (sizeof(bool) + sizeof(int)) * conflict_clause.num_literals;
-  void *data = (void *)malloc(buffer_size);
-  bool *sign_ptr = (bool *)data;
-  int *var_ptr = (int *)(sign_ptr + conflict_clause.num_literals);
-  for (int i = 0; i < conflict_clause.num_literals; i++) {
-    sign_ptr[i] = conflict_clause.literal_signs[i];
-    var_ptr[i] = conflict_clause.literal_variable_ids[i];
+  std::vector<short> recipients;
+  overlay_next_hops(origin, sender, recipients);
+  if (recipients.empty()) {
+    return;
   }
-  MPI_Request request;
-  MPI_Isend(data, buffer_size, MPI_CHAR, recipient, 6, 
-    MPI_COMM_WORLD, &request);
-  if (PRINT_INTERCONNECT) printf(" I(message type 6 [%d -> %d] sent) (id = %d)\n", Interconnect::pid, recipient, Interconnect::dead_message_queue.index);
-  Interconnect::dead_message_queue.add_to_queue(data, request);
+  int num_ints = 1;
+  for (Clause clause : clauses) {
+    num_ints += clause.num_literals + 1;
+  }
+  int *buffer = acquire_clause_buffer(sizeof(int) * num_ints);
+  int *batch = (int *)((char *)buffer + CLAUSE_HEADER_BYTES);
+  batch[0] = origin;
+  int position = 1;
+  for (Clause clause : clauses) {
+    position += write_clause(clause, batch + position);
+  }
+  send_clause_buffer(buffer, sizeof(int) * num_ints, recipients);
 }
 
 // Returns whether there is already work stashed from a sender, or
@@ -148,45 +1023,58 @@ Message Interconnect::get_stashed_work(short sender) {
 // Frees up saved dead messages
 void Interconnect::clean_dead_messages(bool always_free) {
   if (PRINT_LEVEL >= 2) printf("\tPID %d: cleaning_dead_message\n", Interconnect::pid);
-  int num_to_check = Interconnect::dead_message_queue.count;
-  int num_checked = 0;
+  if (Interconnect::num_sends_in_flight == 0) {
+    return;
+  }
+  if (always_free) {
+    // Exiting, so the sends still in flight keep their buffers
+    for (int slot = 0; slot < Interconnect::num_send_slots; slot++) {
+      if (Interconnect::send_requests[slot] != MPI_REQUEST_NULL) {
+        if (PRINT_INTERCONNECT) printf(" I(PID %d explicitly freed message %d)\n", Interconnect::pid, slot);
+        MPI_Request_free(&(Interconnect::send_requests[slot]));
+        Interconnect::send_kinds[slot] = 'n';
+        Interconnect::free_send_slots[Interconnect::num_free_send_slots++] = slot;
+      }
+    }
+    Interconnect::num_sends_in_flight = 0;
+    return;
+  }
   int num_cleaned = 0;
-  void *message;
-  MPI_Status status;
-  MPI_Request request;
-  while (num_checked < num_to_check) {
-    int flag = 0;
-    int message_id;
-    request = Interconnect::dead_message_queue.peak_front(&message_id);
-    if (always_free) {
-      if (PRINT_INTERCONNECT) printf(" I(PID %d explicitly freed message %d)\n", Interconnect::pid, message_id);
-      message = Interconnect::dead_message_queue.pop_from_front();
-      free(message);
-    } else {
-      MPI_Test(&request, &flag, &status);
-      if (!flag) {
-        if (PRINT_INTERCONNECT) printf(" I(PID %d could not free message %d)\n", Interconnect::pid, message_id);
-        return;
+  MPI_Testsome(Interconnect::num_send_slots, Interconnect::send_requests, 
+    &num_cleaned, Interconnect::completed_send_slots, MPI_STATUSES_IGNORE);
+  if (num_cleaned == MPI_UNDEFINED) {
+    num_cleaned = 0;
+  }
+  for (int i = 0; i < num_cleaned; i++) {
+    int slot = Interconnect::completed_send_slots[i];
+    if (PRINT_INTERCONNECT) printf(" I(PID %d freed message %d)\n", Interconnect::pid, slot);
+    if (Interconnect::send_kinds[slot] == 'f') {
+      free(Interconnect::send_buffers[slot]);
+    } else if (Interconnect::send_kinds[slot] == 'c') {
+      int *buffer = (int *)Interconnect::send_buffers[slot];
+      if (--buffer[0] == 0) {
+        Interconnect::clause_pool.push_back(buffer);
       }
-      if (PRINT_INTERCONNECT) printf(" I(PID %d freed message %d)\n", Interconnect::pid, message_id);
-      message = Interconnect::dead_message_queue.pop_from_front();
-      free(message);
     }
-    num_checked++;
+    Interconnect::send_kinds[slot] = 'n';
+    Interconnect::free_send_slots[Interconnect::num_free_send_slots++] = slot;
   }
+  Interconnect::num_sends_in_flight -= num_cleaned;
   if (PRINT_LEVEL >= 2) printf("\tPID %d: cleaning_dead_message cleaned = %d\n", Interconnect::pid, num_cleaned);
 }
 
 // Waits until all messages have been delivered, freeing dead message
 // queue along the way.
 void Interconnect::blocking_wait_for_message_delivery() {
-  while (Interconnect::dead_message_queue.count > 0) {
+  while (Interconnect::num_sends_in_flight > 0) {
     clean_dead_messages();
   }
 }
 
 // Frees the interconnect data structures
 void Interconnect::free_interconnect() {
+  stop_progress_thread();
+  quiesce();
   for (short i = 0; i < Interconnect::nproc; i++) {
     if (Interconnect::work_is_stashed[i]) {
       free((Interconnect::stashed_work[i]).data);
@@ -197,4 +1085,39 @@ void Interconnect::free_interconnect() {
   free(Interconnect::stashed_work);
   free(Interconnect::work_is_stashed);
   clean_dead_messages(true);
+  free(Interconnect::send_requests);
+  free(Interconnect::send_buffers);
+  free(Interconnect::send_kinds);
+  free(Interconnect::free_send_slots);
+  free(Interconnect::completed_send_slots);
+  // An unsent batch is dropped, the search is over
+  if (Interconnect::clause_batch != NULL) {
+    Interconnect::clause_pool.push_back(Interconnect::clause_batch);
+    Interconnect::clause_batch = NULL;
+    Interconnect::clause_batch_ints = 0;
+  }
+  for (int *buffer : Interconnect::clause_pool) {
+    free(buffer);
+  }
+  Interconnect::clause_pool.clear();
+  free(Interconnect::clause_signatures);
+  free(Interconnect::clauses_pulled);
+  if (Interconnect::receives_posted) {
+    for (short slot = 0; slot < RECEIVE_SLOTS; slot++) {
+      if (!Interconnect::receive_held[slot]) {
+        MPI_Cancel(&(Interconnect::receive_requests[slot]));
+        MPI_Wait(&(Interconnect::receive_requests[slot]), MPI_STATUS_IGNORE);
+      }
+      MPI_Request_free(&(Interconnect::receive_requests[slot]));
+      free(Interconnect::receive_buffers[slot]);
+    }
+    free(Interconnect::receive_requests);
+    free(Interconnect::receive_buffers);
+    free(Interconnect::receive_held);
+    Interconnect::receives_posted = false;
+  }
+  for (void *buffer : Interconnect::buffer_pool) {
+    free(buffer);
+  }
+  Interconnect::buffer_pool.clear();
 }
\ No newline at end of file
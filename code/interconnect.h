@@ -1,43 +1,263 @@
 #ifndef INTERCONNECT_H
 #define INTERCONNECT_H
 
+#include <chrono>
 #include <cstdint>
 #include <string>
+#include <thread>
+#include <vector>
 #include "helpers.h"
 #include "cnf.h"
 
+// How learned clauses travel between ranks
+#define CLAUSE_OVERLAY_DIRECT 0 // origin sends to every rank
+#define CLAUSE_OVERLAY_TREE 1 // along the work tree
+#define CLAUSE_OVERLAY_HYPERCUBE 2 // binomial tree rooted at the origin
+#define CLAUSE_OVERLAY_RING 3 // rank to rank back round to the origin
+#define CLAUSE_OVERLAY_RMA 4 // peers pull from each rank's clause ring window
+
+// What a rank's termination broadcast says, other than the winner's id
+#define TERMINATION_QUIET -1 // it found nothing
+#define TERMINATION_EXHAUSTED -2 // the search space is exhausted, no solution
+
+// Returns the clause overlay named, or -1 if there is none by that name
+short clause_overlay_from_name(std::string name);
+
 class Interconnect {
     public:
         int pid;
         int nproc;
-        int work_bytes;
         Message *stashed_work;
         bool *work_is_stashed;
         short num_stashed_work;
-        DeadMessageQueue dead_message_queue;
+        int num_send_slots;
+        MPI_Request *send_requests; // MPI_REQUEST_NULL while the slot is free
+        void **send_buffers;
+        char *send_kinds; // n(othing to release) f(ree) c(lause pool)
+        int *free_send_slots;
+        int num_free_send_slots;
+        int *completed_send_slots; // filled by MPI_Testsome
+        int num_sends_in_flight;
+        std::vector<int *> clause_pool; // spare conflict clause send buffers
+        int *clause_batch; // clauses waiting to be broadcast, NULL if none
+        int clause_batch_ints;
+        std::chrono::steady_clock::time_point clause_batch_started;
+        short clause_overlay;
+        short branching_factor; // of the tree overlay
+        uint64_t *clause_signatures; // recently seen clauses, direct mapped
+        int clause_messages_sent;
+        MPI_Win clause_window; // ring of the clauses we learned, in rma mode
+        int *clause_ring; // its local memory, clauses published then slots
+        int clause_ring_slot_ints; // sequence number, length and literals
+        int *peer_clause_ring; // a peer's ring as last pulled
+        int *clauses_pulled; // clauses published per peer that we have seen
+        std::chrono::steady_clock::time_point last_clause_pull;
+        int clauses_imported;
+        MPI_Comm node_comm; // ranks on our host
+        MPI_Win shared_window; // their mailboxes and clause rings
+        int *shared_region; // ours, NULL without other ranks on our host
+        int **peer_regions; // per rank, NULL for ranks on other hosts
+        int shared_ring_ints; // clause ring ahead of the mailboxes
+        int mailbox_ints; // full flag, bytes and work
+        int num_off_node_ranks;
+        int work_via_shared_memory;
+        std::vector<short> host_peers; // other ranks on our host
+        std::vector<short> other_host_ranks;
+        std::vector<bool> on_our_host; // per rank, empty until discovered
+        bool receives_posted;
+        int message_capacity; // bytes every receive buffer holds
+        MPI_Request *receive_requests; // persistent, matched in ring order
+        void **receive_buffers;
+        bool *receive_held; // slots whose message is being handled
+        short next_receive_slot;
+        std::vector<void *> buffer_pool; // spare receive buffers
+        std::thread *progress_thread; // NULL unless one is receiving for us
+        bool progress_thread_stopping;
+        MessageRing received_messages; // progress thread to solver
+        MessageRing released_buffers; // solver back to progress thread, data only
+        bool termination_open;
+        MPI_Comm *termination_comms; // per rank, for the broadcast it roots
+        MPI_Request *termination_requests;
+        int *termination_winners; // what each rank broadcast, its id if it won
+        int *termination_indices; // filled by MPI_Testsome
+        bool solution_broadcast; // whether our own broadcast has started
+        bool termination_heard;
+        bool search_exhausted; // heard or proved that there is no solution
+        std::chrono::steady_clock::time_point solution_found_at;
+        double quiesce_seconds; // from our solution to all ranks quiet, else -1
 
-        Interconnect(int pid, int nproc, int work_bytes);
+        Interconnect(int pid, int nproc);
+
+        // Starts the persistent receives, no message may exceed capacity
+        void post_receives(int capacity);
         
         // Receives one async messages, returns false if nothing received
         bool async_receive_message(Message &message);
 
+        // Takes the next completed receive off the ring, returns false if
+        // there is none. Detached messages leave their slot receiving again
+        // at once.
+        bool poll_receive_ring(Message &message, bool detach = false);
+
+        // Starts a thread receiving messages for the solver, if PROGRESS_THREAD
+        // is set and MPI allows it
+        void start_progress_thread();
+
+        // Receives messages and recycles their buffers until told to stop
+        void progress_loop();
+
+        // Joins the progress thread, dropping messages it had not handed over
+        void stop_progress_thread();
+
+        // Returns a spare receive buffer, recycled when possible
+        void *acquire_receive_buffer();
+
+        // Returns a received message's data for reuse
+        void release_buffer(void *buffer);
+
+        // Restarts the receive slot a buffer belongs to or pools it
+        void recycle_buffer(void *buffer);
+
+        // Takes a free send slot, adding slots when every one is in flight
+        int claim_send_slot();
+
+        // Sends data from a slot, kind says how data is released once delivered
+        void start_send(
+            void *data, 
+            int num_bytes, 
+            short recipient, 
+            short type, 
+            char kind, 
+            void *buffer);
+
         // Sends message asking for work
         void send_work_request(short recipient, short version);
         
         // Sends work data to recipient
-        void send_work(short recipient, void *work);
+        void send_work(short recipient, void *work, int num_bytes);
 
         // Sends an abort message
         void send_abort_message(short recipient);
 
+        // Tells a rank that asked for work that we have none to spare, and
+        // how many tasks we hold
+        void send_steal_refusal(short recipient, int load);
+
+        // Passes the termination token on with the work messages counted sent
+        // less received so far, and whether any rank it passed received work
+        void send_termination_token(short recipient, int count, bool touched);
+
+        // Posts a broadcast from every other rank, the first to find a
+        // solution completes its own. Collective.
+        void open_termination();
+
+        // Broadcasts that we found a solution
+        void announce_solution();
+
+        // Broadcasts that no rank can find a solution
+        void announce_exhaustion();
+
+        // Returns whether another rank has broadcast a solution or exhaustion
+        bool termination_announced();
+
+        // Broadcasts that we found nothing unless we already announced, then
+        // discards arrivals until our sends are delivered and every rank has
+        // done the same. Collective.
+        void quiesce();
+
         // Sends an invalidation message
         void send_invalidation(short recipient);
 
-        // Sends a conflict clause to a recipient
-        void send_conflict_clause(
-            short recipient, 
-            Clause conflict_clause,
-            bool broadcast = false);
+        // Returns a pooled clause buffer with room for num_bytes of clauses
+        int *acquire_clause_buffer(int num_bytes);
+
+        // Sends the clauses in a pooled buffer to each recipient. The buffer
+        // returns to the pool once delivered.
+        void send_clause_buffer(
+            int *buffer, 
+            int num_bytes, 
+            std::vector<short> &recipients);
+
+        // Sends a conflict clause to a recipient right away
+        void send_conflict_clause(short recipient, Clause conflict_clause);
+
+        // Adds a conflict clause to the batch for every other rank, flushing
+        // it first if the clause would overfill it
+        void queue_conflict_clause(Clause conflict_clause);
+
+        // Broadcasts the batched conflict clauses if forced or once the
+        // oldest has waited CLAUSE_BATCH_MICROSECONDS
+        void flush_conflict_clauses(bool force);
+
+        // Picks how learned clauses travel between ranks, the tree overlay
+        // follows the work tree of the given branching factor
+        void set_clause_overlay(short overlay, short branching_factor);
+
+        // Collects the ranks clauses learned by origin go on to from here,
+        // given the rank they came from (-1 if they are ours)
+        void overlay_next_hops(
+            short origin, 
+            short sender, 
+            std::vector<short> &hops);
+
+        // Returns whether a clause was seen recently, remembering it if not
+        bool clause_seen(Clause clause);
+
+        // Opens the clause ring window of every rank in rma mode. Collective.
+        void open_clause_window(int max_clause_literals);
+
+        // Frees the clause ring window. Collective, so only once every rank
+        // has finished searching.
+        void close_clause_window();
+
+        // Finds which ranks run on our host. Collective.
+        void discover_topology();
+
+        // Returns whether a rank runs on our host
+        bool shares_host(short rank);
+
+        // Maps the work mailboxes and clause rings of every rank on our host.
+        // Collective.
+        void open_shared_memory(int max_clause_literals);
+
+        // Unmaps the shared regions. Collective, so only once every rank has
+        // finished searching.
+        void close_shared_memory();
+
+        // Returns sender's work mailbox in receiver's region, NULL unless
+        // the two share our host and are work tree neighbours
+        int *work_mailbox(short receiver, short sender);
+
+        // Returns whether clauses reach a rank through its shared clause
+        // ring rather than messages
+        bool shares_clause_ring(short rank);
+
+        // Adds a clause to our shared clause ring, overwriting the oldest
+        void publish_shared_conflict_clause(Clause conflict_clause);
+
+        // Copies out the clauses published to shared rings since the last
+        // pull
+        void pull_shared_conflict_clauses(std::vector<Clause> &clauses);
+
+        // Returns whether this rank pulls clauses at safe points rather than
+        // having them all sent
+        bool pulls_clauses();
+
+        // Adds a clause to our ring, overwriting the oldest
+        void publish_conflict_clause(Clause conflict_clause);
+
+        // Returns whether CLAUSE_PULL_MICROSECONDS have passed since the
+        // last pull
+        bool clause_pull_due();
+
+        // Copies out the clauses peers have published since the last pull
+        void pull_conflict_clauses(std::vector<Clause> &clauses);
+
+        // Passes clauses received from sender on along the overlay
+        void forward_conflict_clauses(
+            std::vector<Clause> &clauses, 
+            short origin, 
+            short sender);
 
         // Returns whether there is already work stashed from a sender, or
         // from anyone if sender is -1.
@@ -2,6 +2,7 @@
 #include "interconnect.h"
 #include "state.h"
 #include <string>
+#include <vector>
 #include <iostream>
 #include <fstream>
 #include <iomanip>
@@ -12,17 +13,14 @@
 #include <unistd.h>
 #include <cmath> 
 
-// Runs algorithm on input sudoku puzzle
-void run_filename(
+// Reads a puzzle file and encodes it into a formula
+Cnf encode_puzzle_file(
         int pid,
         int nproc,
         std::string input_filename, 
-        short branching_factor, 
-        short assignment_method,
-        int reduction_method) 
+        int reduction_method,
+        short *encodings) 
     {
-    const auto init_start = std::chrono::steady_clock::now();
-
     int n;
     int sqrt_n;
     int num_constraints;
@@ -31,14 +29,57 @@ void run_filename(
     int **constraints = read_puzzle_file(
         input_filename, &n, &sqrt_n, &num_constraints, 
         &num_assignments, assignments);
-
-    Cnf cnf(pid, nproc, constraints, n, 
+    return Cnf(pid, nproc, constraints, n, 
         sqrt_n, num_constraints, num_assignments, 
-        reduction_method, assignments);
+        reduction_method, assignments, encodings, USE_FORMULA_TEMPLATES);
+}
+
+// Broadcasts rank 0's formula image, every other rank loads it
+void share_formula(int pid, int nproc, Cnf &cnf) {
+    if (nproc == 1) {
+        return;
+    }
+    int image_ints = 0;
+    int *image = NULL;
+    if (pid == 0) {
+        image = cnf.to_formula_image(&image_ints);
+    }
+    MPI_Bcast(&image_ints, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (pid != 0) {
+        image = (int *)malloc(sizeof(int) * image_ints);
+    }
+    MPI_Bcast(image, image_ints, MPI_INT, 0, MPI_COMM_WORLD);
+    if (pid != 0) {
+        cnf.load_formula_image(pid, nproc, image);
+    }
+    free(image);
+}
+
+// Runs algorithm on input sudoku puzzle
+void run_filename(
+        int pid,
+        int nproc,
+        std::string input_filename, 
+        short branching_factor, 
+        short assignment_method,
+        int reduction_method,
+        short *encodings,
+        short clause_overlay,
+        short steal_mode) 
+    {
+    const auto init_start = std::chrono::steady_clock::now();
+
+    // Only rank 0 encodes the puzzle, the others load its formula image
+    Cnf cnf = pid == 0 
+        ? encode_puzzle_file(pid, nproc, input_filename, reduction_method, encodings) 
+        : Cnf();
+    share_formula(pid, nproc, cnf);
     Deque task_stack;
-    Interconnect interconnect(pid, nproc, cnf.work_ints * 4);
+    Interconnect interconnect(pid, nproc);
+    interconnect.set_clause_overlay(clause_overlay, branching_factor);
     State state(pid, nproc, branching_factor, 
         assignment_method);
+    state.steal_mode = steal_mode;
 
     if (pid == 0) {
         const double init_time = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - init_start).count();
@@ -49,28 +90,76 @@ void run_filename(
     bool result = state.solve(cnf, task_stack, interconnect);
 
     if (PRINT_LEVEL > 0) printf("\tPID %d: Solve called %llu times\n", pid, state.calls_to_solve);
+    if (PRINT_STEAL_STATS && state.num_reconstructs > 0) {
+        printf("\tPID %d: %d reconstructs (%d incremental), %.3f ms each, %.3f ms to first decision, %d bundled clauses added\n", 
+            pid, state.num_reconstructs, state.num_incremental_reconstructs, 
+            1e3 * state.reconstruct_time / state.num_reconstructs, 
+            1e3 * state.time_to_first_decision / state.num_reconstructs,
+            state.num_bundled_clauses_added);
+    }
+    if (PRINT_STEAL_STATS && state.num_work_sent > 0) {
+        printf("\tPID %d: %d work messages sent, %.1f bytes per steal, 2^%.1f nodes estimated per task given\n", 
+            pid, state.num_work_sent, (double)state.work_bytes_sent / state.num_work_sent,
+            state.given_log_size_sum / std::max(state.num_work_grabbed, 1));
+    }
+    if (PRINT_STEAL_STATS && state.num_steal_attempts > 0) {
+        printf("\tPID %d: %d random steals tried, %d refused, %.3f ms from first try to work on average\n", 
+            pid, state.num_steal_attempts, state.num_steals_refused, 
+            1e3 * state.steal_wait_total / std::max(state.num_steals_won, 1));
+    }
+    if (PRINT_STEAL_STATS && state.num_remote_work_sent > 0) {
+        printf("\tPID %d: %d work messages sent to other hosts, %lld bytes\n", 
+            pid, state.num_remote_work_sent, state.remote_work_bytes_sent);
+    }
+    if (PRINT_STEAL_STATS && state.num_polls > 0) {
+        printf("\tPID %d: polled every %.1f us (%.1f iterations) on average, %d iterations between the last polls\n", 
+            pid, state.poll_microseconds_total / state.num_polls, 
+            (double)state.poll_iterations_total / state.num_polls, state.poll_interval);
+    }
+    if (PRINT_STEAL_STATS && interconnect.clause_messages_sent > 0) {
+        printf("\tPID %d: %d clause messages sent\n", pid, interconnect.clause_messages_sent);
+    }
+    if (PRINT_STEAL_STATS && interconnect.clauses_imported > 0) {
+        printf("\tPID %d: %d clauses pulled from peers\n", pid, interconnect.clauses_imported);
+    }
+    if (PRINT_STEAL_STATS && interconnect.work_via_shared_memory > 0) {
+        printf("\tPID %d: %d work messages handed over in shared memory\n", pid, interconnect.work_via_shared_memory);
+    }
     
     const double compute_time = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - compute_start).count();
     // std::cout << "Computation time (sec): " << std::fixed << std::setprecision(10) << compute_time << '\n';
 
+    // Ranks can finish solutions at the same time, the lowest one reports
+    int winner = result ? pid : nproc;
+    MPI_Allreduce(MPI_IN_PLACE, &winner, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    interconnect.close_clause_window();
+    interconnect.close_shared_memory();
     MPI_Finalize();
 
     if (state.was_explicit_abort) {
         // A solution was found
-        if (!result) {
+        if (winner != pid) {
             // someone else has the solution
             cnf.free_cnf();
             return;
         }
         printf("Solution found for puzzle %s by PID %d; called solve_iteration %llu times\n", input_filename.c_str(), pid, state.calls_to_solve);
         std::cout << "Solution (n = " << nproc << ") computation time (sec): " << std::fixed << std::setprecision(10) << compute_time << '\n';
+        if (interconnect.quiesce_seconds >= 0) {
+            std::cout << "Time from solution to all ranks quiesced (sec): " << std::fixed << std::setprecision(10) << interconnect.quiesce_seconds << '\n';
+        }
     } else {
-        // No solution was found
+        // No solution was found, every rank knows so one reports it
+        if (pid != 0) {
+            cnf.free_cnf();
+            return;
+        }
+        std::cout << "No solution (n = " << nproc << ") computation time (sec): " << std::fixed << std::setprecision(10) << compute_time << '\n';
         raise_error("No solution was found");
     }
     short **board = cnf.get_sudoku_board();
     print_board(board, cnf.n);
-    for (int i = 0; i < n; i++) {
+    for (int i = 0; i < cnf.n; i++) {
         free(board[i]);
     }
     free(board);
@@ -83,7 +172,10 @@ void run_tests(
         short test_length,
         short branching_factor, 
         short assignment_method,
-        int reduction_method) 
+        int reduction_method,
+        short *encodings,
+        short clause_overlay,
+        short steal_mode) 
     {
     int n = 16;
     int sqrt_n = 4;
@@ -124,11 +216,13 @@ void run_tests(
 
     Cnf cnf(pid, nproc, constraints, n, 
         sqrt_n, num_constraints, num_assignments, 
-        reduction_method, assignments);
+        reduction_method, assignments, encodings);
     Deque task_stack;
-    Interconnect interconnect(pid, nproc, cnf.work_ints * 4);
+    Interconnect interconnect(pid, nproc);
+    interconnect.set_clause_overlay(clause_overlay, branching_factor);
     State state(pid, nproc, branching_factor, 
         assignment_method);
+    state.steal_mode = steal_mode;
 
     const auto compute_start = std::chrono::steady_clock::now();
 
@@ -139,11 +233,16 @@ void run_tests(
     const double compute_time = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - compute_start).count();
     std::cout << "Computation time (sec): " << std::fixed << std::setprecision(10) << compute_time << '\n';
 
+    // Ranks can finish solutions at the same time, the lowest one reports
+    int winner = result ? pid : nproc;
+    MPI_Allreduce(MPI_IN_PLACE, &winner, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    interconnect.close_clause_window();
+    interconnect.close_shared_memory();
     MPI_Finalize();
 
     if (state.was_explicit_abort) {
         // A solution was found
-        if (!result) {
+        if (winner != pid) {
             // someone else has the solution
             cnf.free_cnf();
             return;
@@ -166,6 +265,77 @@ void run_tests(
     fin.close();
 }
 
+// Reports formula size and single process solve time of each encoding
+void run_encoding_benchmark(
+        int pid,
+        std::string input_filename,
+        short branching_factor,
+        short assignment_method)
+    {
+    // Slow encodings on big grids are reported as timed out
+    double time_limit = 60;
+    if (pid != 0) {
+        MPI_Finalize();
+        return;
+    }
+    std::vector<std::string> filenames;
+    if (input_filename.empty()) {
+        filenames = {
+            "inputs/4_blank.txt", "inputs/9_blank.txt", "inputs/9_k1.txt",
+            "inputs/16_blank.txt", "inputs/16_k4.txt", "inputs/25_blank.txt"};
+    } else {
+        filenames.push_back(input_filename);
+    }
+    printf("%-20s %3s %3s %-11s %9s %9s %10s %12s %12s\n", "input", "n", "r", "encoding", "variables", "clauses", "literals", "build (sec)", "solve (sec)");
+    for (std::string filename : filenames) {
+        // -r 0 and -r 1 first for reference, then -r 2 with every encoding
+        for (int config = -2; config < NUM_ENCODINGS; config++) {
+            int reduction_method = config < 0 ? config + 2 : 2;
+            short encodings[NUM_GROUP_TYPES];
+            for (int group_type = 0; group_type < NUM_GROUP_TYPES; group_type++) {
+                encodings[group_type] = config < 0 ? ENCODING_DEFAULT : (short)config;
+            }
+            int n;
+            int sqrt_n;
+            int num_constraints;
+            int num_assignments;
+            GridAssignment *assignments;
+            int **constraints = read_puzzle_file(
+                filename, &n, &sqrt_n, &num_constraints, 
+                &num_assignments, assignments);
+
+            const auto build_start = std::chrono::steady_clock::now();
+            Cnf cnf(0, 1, constraints, n, sqrt_n, num_constraints, 
+                num_assignments, reduction_method, assignments, encodings);
+            const double build_time = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - build_start).count();
+            unsigned long long num_literals = 0;
+            for (int clause_id = 0; clause_id < cnf.clauses.num_indexed; clause_id++) {
+                num_literals += cnf.clauses.get_clause(clause_id).num_literals;
+            }
+
+            Deque task_stack;
+            Interconnect interconnect(0, 1);
+            State state(0, 1, branching_factor, assignment_method);
+            state.time_limit = time_limit;
+            const auto solve_start = std::chrono::steady_clock::now();
+            bool result = state.solve(cnf, task_stack, interconnect);
+            const double solve_time = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - solve_start).count();
+            if (!result && !state.timed_out) {
+                raise_error("No solution was found");
+            }
+
+            std::string encoding = config < 0 ? "-" : encoding_name(config);
+            std::string name = filename.substr(filename.find_last_of('/') + 1);
+            std::string solve_string = state.timed_out ? "timeout" : std::to_string(solve_time);
+            printf("%-20s %3d %3d %-11s %9d %9d %10llu %12.6f %12s\n", name.c_str(), n, reduction_method, encoding.c_str(), cnf.num_variables, cnf.clauses.num_indexed, num_literals, build_time, solve_string.c_str());
+            fflush(stdout);
+            task_stack.free_data();
+            cnf.free_cnf();
+        }
+    }
+    MPI_Finalize();
+}
+
 // Outputs memory stats in terms of B, KB, MB, GB, or TB and shrinks size
 void truncate_size(unsigned long long int &input_size, std::string &suffix) {
     if (input_size > (unsigned long long int)(1000000000000)) {
@@ -268,11 +438,120 @@ void print_memory_stats() {
     printf("\n");
 }
 
+// Reports compressed state encode/decode throughput at n = 9, 16, 25 and 36,
+// and the bytes a steal takes from partway through a search
+void run_codec_benchmark(
+        int pid, 
+        short branching_factor, 
+        short assignment_method, 
+        int reduction_method, 
+        short *encodings) 
+    {
+    if (pid != 0) {
+        MPI_Finalize();
+        return;
+    }
+    std::vector<std::string> filenames = {
+        "inputs/9_blank.txt", "inputs/16_blank.txt", 
+        "inputs/25_blank.txt", "inputs/36_blank.txt"};
+    printf("%-14s %3s %8s %14s %14s %16s %12s %12s %12s %12s\n", "input", "n", "words", "pack (ns/w)", "unpack (ns/w)", "reconstruct (us)", "bitmap (B)", "packed (B)", "encode (us)", "decode (us)");
+    for (std::string filename : filenames) {
+        int n;
+        int sqrt_n;
+        int num_constraints;
+        int num_assignments;
+        GridAssignment *assignments;
+        int **constraints = read_puzzle_file(
+            filename, &n, &sqrt_n, &num_constraints, 
+            &num_assignments, assignments);
+        Cnf cnf(0, 1, constraints, n, sqrt_n, num_constraints, 
+            num_assignments, reduction_method, assignments, encodings);
+        int state_words = cnf.work_ints - WORK_TRAILER_INTS;
+        // Random bits, so no branch of the codec is favoured
+        bool *bits = (bool *)malloc(sizeof(bool) * 32 * state_words);
+        for (int i = 0; i < 32 * state_words; i++) {
+            bits[i] = rand() & 1;
+        }
+        unsigned int *words = (unsigned int *)malloc(sizeof(unsigned int) * state_words);
+        int iterations = std::max(10, 50000000 / (32 * state_words));
+
+        const auto pack_start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            pack_bits(bits, words, state_words);
+            bits[i % (32 * state_words)] ^= words[i % state_words] & 1;
+        }
+        const double pack_time = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - pack_start).count();
+
+        const auto unpack_start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            unpack_bits(words, bits, state_words);
+            words[i % state_words] ^= bits[i % (32 * state_words)];
+        }
+        const double unpack_time = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - unpack_start).count();
+
+        // Full decode of the initial state, as a thief does for stolen work
+        int reconstructs = std::max(10, iterations / 100);
+        Deque task_stack;
+        double reconstruct_time = 0;
+        for (int i = 0; i < reconstructs; i++) {
+            unsigned int *work = (unsigned int *)malloc(sizeof(unsigned int) * cnf.work_ints);
+            memcpy(work, cnf.oldest_compressed, sizeof(unsigned int) * cnf.work_ints);
+            const auto reconstruct_start = std::chrono::steady_clock::now();
+            if (!cnf.reconstruct_state(work, cnf.work_ints, task_stack)) {
+                free(work);
+            }
+            reconstruct_time += std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - reconstruct_start).count();
+        }
+
+        // Stop a search partway, its state is what a steal would send
+        Interconnect interconnect(0, 1);
+        State state(0, 1, branching_factor, assignment_method);
+        state.time_limit = 0.05;
+        state.solve(cnf, task_stack, interconnect);
+        unsigned int *search_state = cnf.to_int_rep();
+        unsigned char *packed = (unsigned char *)malloc(sizeof(unsigned int) * (cnf.work_ints + 1));
+        int packed_bytes = 0;
+        const auto encode_start = std::chrono::steady_clock::now();
+        for (int i = 0; i < reconstructs; i++) {
+            packed_bytes = cnf.pack_compressed(search_state, packed);
+        }
+        const double encode_time = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - encode_start).count();
+        const auto decode_start = std::chrono::steady_clock::now();
+        for (int i = 0; i < reconstructs; i++) {
+            free(cnf.unpack_compressed(packed));
+        }
+        const double decode_time = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - decode_start).count();
+        // Messages also carry the task and format, here without clauses
+        int bitmap_bytes = sizeof(unsigned int) * cnf.work_ints;
+        packed_bytes = sizeof(unsigned int) * (ceil_div(packed_bytes, sizeof(unsigned int)) + WORK_TRAILER_INTS);
+
+        std::string name = filename.substr(filename.find_last_of('/') + 1);
+        printf("%-14s %3d %8d %14.3f %14.3f %16.2f %12d %12d %12.2f %12.2f\n", name.c_str(), n, state_words, 
+            1e9 * pack_time / ((double)iterations * state_words), 
+            1e9 * unpack_time / ((double)iterations * state_words), 
+            1e6 * reconstruct_time / reconstructs,
+            bitmap_bytes, packed_bytes, 
+            1e6 * encode_time / reconstructs, 
+            1e6 * decode_time / reconstructs);
+        fflush(stdout);
+        free(bits);
+        free(words);
+        free(search_state);
+        free(packed);
+        task_stack.free_data();
+        cnf.free_cnf();
+    }
+    MPI_Finalize();
+}
+
 // Calls various commands after parsing arguments
 int main(int argc, char *argv[]) {
     int pid;
     int nproc;
-    MPI_Init(&argc, &argv); // Initialize MPI
+    // Initialize MPI, the progress thread receives alongside the solver
+    int thread_level;
+    MPI_Init_thread(&argc, &argv, 
+        PROGRESS_THREAD ? MPI_THREAD_MULTIPLE : MPI_THREAD_SINGLE, &thread_level);
     MPI_Comm_rank(MPI_COMM_WORLD, &pid); // Get process rank
     MPI_Comm_size(MPI_COMM_WORLD, &nproc);
 
@@ -284,7 +563,13 @@ int main(int argc, char *argv[]) {
     short branching_factor = 2;
     short assignment_method = 1;
     int reduction_method = 1;
-    while ((opt = getopt(argc, argv, "c:f:l:b:m:r:")) != -1) {
+    short encodings[NUM_GROUP_TYPES];
+    for (int group_type = 0; group_type < NUM_GROUP_TYPES; group_type++) {
+        encodings[group_type] = ENCODING_DEFAULT;
+    }
+    short clause_overlay = CLAUSE_OVERLAY_DIRECT;
+    short steal_mode = STEAL_TREE;
+    while ((opt = getopt(argc, argv, "c:f:l:b:m:r:e:s:w:")) != -1) {
         switch (opt) {
             case 'c':
                 command = optarg;
@@ -310,6 +595,29 @@ int main(int argc, char *argv[]) {
                     printf("\n\tWARNING: use of a naive SAT reduction may result in exponentially-prolonged runtime!\n\n");
                 }
                 break;
+            case 'e':
+                if (!parse_encodings(optarg, encodings)) {
+                    std::cerr << "Encodings must be one or five comma separated ids in [0, " << NUM_ENCODINGS << ")\n";
+                    MPI_Finalize();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                clause_overlay = clause_overlay_from_name(optarg);
+                if (clause_overlay == -1) {
+                    std::cerr << "Clause sharing must be direct, tree, hypercube or ring\n";
+                    MPI_Finalize();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                steal_mode = steal_mode_from_name(optarg);
+                if (steal_mode == -1) {
+                    std::cerr << "Work stealing must be tree, random, two or node\n";
+                    MPI_Finalize();
+                    exit(EXIT_FAILURE);
+                }
+                break;
             default:
                 std::cerr << "Incorrect command line arguments\n";  
                 MPI_Finalize();    
@@ -323,7 +631,10 @@ int main(int argc, char *argv[]) {
             input_filename, 
             branching_factor, 
             assignment_method, 
-            reduction_method);
+            reduction_method,
+            encodings,
+            clause_overlay,
+            steal_mode);
     } else if (command == "runtests") {
         run_tests(
             pid,
@@ -331,7 +642,19 @@ int main(int argc, char *argv[]) {
             test_length,
             branching_factor, 
             assignment_method, 
-            reduction_method);
+            reduction_method,
+            encodings,
+            clause_overlay,
+            steal_mode);
+    } else if (command == "benchmark") {
+        run_encoding_benchmark(
+            pid,
+            input_filename,
+            branching_factor,
+            assignment_method);
+    } else if (command == "codec") {
+        run_codec_benchmark(
+            pid, branching_factor, assignment_method, reduction_method, encodings);
     } else {
         if (pid == 0) {
             print_memory_stats();
@@ -50,6 +50,29 @@ State::State(
     State::calls_to_solve = 0;
     State::assignment_method = assignment_method;
     State::current_cycle = 0;
+    State::at_formula_root = false;
+    State::poll_interval = 1;
+    State::iterations_since_poll = 0;
+    State::messages_since_poll = 0;
+    State::iteration_microseconds = 0;
+    State::message_rate = 0;
+    State::num_polls = 0;
+    State::poll_microseconds_total = 0;
+    State::poll_iterations_total = 0;
+    State::time_limit = 0;
+    State::timed_out = false;
+    State::num_reconstructs = 0;
+    State::num_incremental_reconstructs = 0;
+    State::reconstruct_time = 0;
+    State::time_to_first_decision = 0;
+    State::awaiting_first_decision = false;
+    State::num_work_sent = 0;
+    State::num_bundled_clauses_added = 0;
+    State::work_bytes_sent = 0;
+    State::given_log_size_sum = 0;
+    State::num_work_grabbed = 0;
+    State::num_leaves = 0;
+    State::mean_leaf_depth = 0;
     Deque thieves;
     State::thieves = (Deque *)malloc(sizeof(Deque));
     *State::thieves = thieves;
@@ -59,6 +82,41 @@ State::State(
     State::current_task = current_task;
 
     State::last_asked_child = State::num_children;
+
+    State::steal_mode = STEAL_TREE;
+    State::steal_outstanding = false;
+    State::steal_backoff = STEAL_BACKOFF_MICROSECONDS;
+    State::next_steal_at = std::chrono::steady_clock::now();
+    State::steal_seed = pid + 1;
+    // Ranks yet to refuse us may have work
+    State::victim_loads = (int *)malloc(sizeof(int) * nprocs);
+    for (short rank = 0; rank < nprocs; rank++) {
+        State::victim_loads[rank] = 2;
+    }
+    State::num_steal_attempts = 0;
+    State::num_steals_refused = 0;
+    State::host_refusals = 0;
+    State::steal_started = false;
+    State::steal_wait_total = 0;
+    State::num_steals_won = 0;
+    State::num_remote_work_sent = 0;
+    State::remote_work_bytes_sent = 0;
+    State::work_balance = 0;
+    State::touched = false;
+    // Rank 0 starts each round of the token
+    State::holding_token = (pid == 0);
+    State::token_returned = false;
+    State::token_count = 0;
+    State::token_touched = false;
+}
+
+// Returns the steal mode named, or -1 if there is none by that name
+short steal_mode_from_name(std::string name) {
+    if (name == "tree") return STEAL_TREE;
+    if (name == "random") return STEAL_RANDOM;
+    if (name == "two") return STEAL_TWO_CHOICES;
+    if (name == "node") return STEAL_NODE_FIRST;
+    return -1;
 }
 
 // Gets child (or parent) pid from child (or parent) index
@@ -94,6 +152,12 @@ bool State::workers_requesting() {
     return State::num_requesting > 0;
 }
 
+// Returns whether idle ranks steal from random ranks rather than their tree
+// neighbours
+bool State::random_stealing() {
+    return State::steal_mode != STEAL_TREE && State::nprocs > 1;
+}
+
 // Returns whether we should forward an urgent request
 bool State::should_forward_urgent_request() {
     if (State::pid == 0) {
@@ -110,9 +174,82 @@ bool State::should_implicit_abort() {
     return (State::num_urgent == State::num_children + 1);
 }
 
-// Returns whether the state is able to supply work to requesters
-bool State::can_give_work(Deque task_stack, Interconnect interconnect) {
-    return ((State::num_non_trivial_tasks + interconnect.num_stashed_work) > 1);
+// Returns whether the state is able to supply work to requesters, declining
+// tasks estimated under 2^min_log_size nodes
+bool State::can_give_work(
+        Cnf &cnf, 
+        Deque &task_stack, 
+        Interconnect &interconnect,
+        double min_log_size) 
+    {
+    if ((State::num_non_trivial_tasks + interconnect.num_stashed_work) <= 1) {
+        return false;
+    }
+    if (interconnect.num_stashed_work > 0) {
+        return true;
+    }
+    // Near-leaf tasks cost the thief more to rebuild than to search here
+    return estimate_oldest_subtree(cnf) >= min_log_size;
+}
+
+// Estimates log2 of the number of nodes under the oldest open task
+double State::estimate_oldest_subtree(Cnf &cnf) {
+    // A decision level settles about one cell, n variables, on average
+    int num_assigned = 0;
+    int vars_end = cnf.ints_needed_for_clauses + 2 * cnf.ints_needed_for_vars;
+    for (int i = cnf.ints_needed_for_clauses; i < vars_end; i++) {
+        num_assigned += __builtin_popcount(cnf.oldest_compressed[i]);
+    }
+    double levels_left = (double)(cnf.num_variables - num_assigned) / cnf.n;
+    if (State::num_leaves > 0) {
+        // Knuth probe: dives from here reached a conflict this deep on
+        // average, with two children per decision on the way down
+        int oldest_depth = cnf.depth - cnf.edit_stack.count;
+        levels_left = std::min(levels_left, State::mean_leaf_depth - oldest_depth);
+    }
+    return std::max(levels_left, 0.0);
+}
+
+// Picks the iterations to run before the next poll from how long they take,
+// the messages arriving, and the requests pending on us
+void State::schedule_next_poll() {
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration_cast<std::chrono::duration<double, std::micro>>(now - State::last_poll).count();
+    elapsed = std::max(elapsed, 1.0);
+    State::num_polls++;
+    State::poll_microseconds_total += elapsed;
+    State::poll_iterations_total += State::iterations_since_poll;
+    if (State::iterations_since_poll > 0) {
+        double sample = elapsed / State::iterations_since_poll;
+        State::iteration_microseconds = (State::iteration_microseconds == 0) ? sample 
+            : POLL_SMOOTHING * sample + (1 - POLL_SMOOTHING) * State::iteration_microseconds;
+        State::message_rate = POLL_SMOOTHING * State::messages_since_poll / elapsed 
+            + (1 - POLL_SMOOTHING) * State::message_rate;
+    }
+    double period = POLL_TARGET_MICROSECONDS;
+    if (workers_requesting()) {
+        // Children waiting on us escalate to urgent requests we must forward
+        period /= 2;
+    }
+    // A burst should not fill the receive ring before we come back
+    if (State::message_rate * period > RECEIVE_SLOTS / 2) {
+        period = (RECEIVE_SLOTS / 2) / State::message_rate;
+    }
+    double iterations = period / std::max(State::iteration_microseconds, 1e-3);
+    State::poll_interval = (int)std::min(std::max(iterations, 1.0), (double)POLL_MAX_ITERATIONS);
+    State::iterations_since_poll = 0;
+    State::messages_since_poll = 0;
+    State::last_poll = now;
+}
+
+// Adds a conflict depth to the running leaf depth average
+void State::record_leaf(int depth) {
+    if (State::num_leaves == 0) {
+        State::mean_leaf_depth = depth;
+    } else {
+        State::mean_leaf_depth += (depth - State::mean_leaf_depth) / LEAF_DEPTH_WINDOW;
+    }
+    State::num_leaves++;
 }
 
 // Ensures the task stack is a valid one
@@ -249,50 +386,12 @@ bool State::task_stack_invariant(
     return true;
 }
 
-// Applies an edit to the given compressed CNF
-void State::apply_edit_to_compressed(
-        Cnf &cnf,
-        unsigned int *compressed, 
-        FormulaEdit edit) 
-    {
-    switch (edit.edit_type) {
-        case 'v': {
-            // Add variable set to it's int offset
-            int variable_id = edit.edit_id;
-            VariableLocations location = cnf.variables[variable_id];
-            unsigned int mask_to_add = location.variable_addition;
-            unsigned int offset;
-            if (cnf.assigned_true[variable_id]) {
-                offset = location.variable_true_addition_index;
-            } else {
-                assert(cnf.assigned_false[variable_id]);
-                offset = location.variable_false_addition_index;
-            }
-            compressed[offset] += mask_to_add;
-
-            cnf.assignment_times[variable_id] = -1; // IMPORTANT
-            cnf.assignment_depths[variable_id] = -1;
-            return;
-        } case 'c': {
-            // Add clause drop to it's int offset
-            int clause_id = edit.edit_id;
-            if (clause_id >= cnf.clauses.max_indexable) return; //don't do for conflict clauses
-            Clause clause = cnf.clauses.get_clause(clause_id);
-            unsigned int mask_to_add = clause.clause_addition;
-            unsigned int offset = clause.clause_addition_index;
-            compressed[offset] += mask_to_add;
-            return;
-        } default: {
-            return;
-        }
-    }
-}
-
 // Grabs work from the top of the task stack, updates Cnf structures
 void *State::grab_work_from_stack(
         Cnf &cnf,
         Deque &task_stack,
-        short recipient_pid)
+        short recipient_pid,
+        int *num_ints)
     {
     if (PRINT_LEVEL > 0) printf("PID %d: grabbing work from stack\n", State::pid);
     print_data(cnf, task_stack, "grabbing work from stack");
@@ -302,7 +401,7 @@ void *State::grab_work_from_stack(
     void *top_task_ptr = task_stack.pop_from_back();
     Task top_task = *((Task *)(top_task_ptr));
     free(top_task_ptr);
-    void *work = cnf.convert_to_work_message(cnf.oldest_compressed, top_task);
+    void *work = cnf.convert_to_work_message(cnf.oldest_compressed, top_task, num_ints);
     if (top_task.assignment) {
         cnf.true_assignment_statuses[top_task.var_id] = 's';
     } else {
@@ -317,16 +416,8 @@ void *State::grab_work_from_stack(
     (*State::thieves).add_to_front((void *)task_to_give_ptr);
     // Prune the top of the tree
     while (backtrack_at_top(task_stack)) {
-        assert(cnf.edit_stack.count > 0);
         // Two deques loose their top element, one looses at least one element
-        Deque edits_to_apply = *((Deque *)((cnf.edit_stack).pop_from_back()));
-        while (edits_to_apply.count > 0) {
-            void *formula_edit_ptr = edits_to_apply.pop_from_back();
-            FormulaEdit edit = *((FormulaEdit *)formula_edit_ptr);
-            free(formula_edit_ptr);
-            apply_edit_to_compressed(cnf, cnf.oldest_compressed, edit);
-        }
-        edits_to_apply.free_deque();
+        cnf.prune_oldest_edit_group();
         // Ditch the backtrack task at the top
         task_stack.pop_from_back();
     }
@@ -334,7 +425,7 @@ void *State::grab_work_from_stack(
     assert(State::num_non_trivial_tasks >= 1);
     if (PRINT_LEVEL > 1) printf("PID %d: grabbing work from stack done\n", State::pid);
     print_data(cnf, task_stack, "grabbed work from stack");
-    if (PRINT_LEVEL > 5) print_compressed(
+    if (PRINT_LEVEL > 5 && ((unsigned int *)work)[*num_ints - 1] == WORK_FORMAT_BITMAP) print_compressed(
         cnf.pid, "giving work", cnf.depth_str, (unsigned int *)work, cnf.work_ints);
     return work;
 }
@@ -411,25 +502,153 @@ void State::give_work(
     if (PRINT_LEVEL > 0) printf("PID %d: giving work\n", State::pid);
     short recipient_index = pick_work_recipient();
     assert(State::child_statuses[recipient_index] != 'w');
-    short recipient_pid = pid_from_child_index(recipient_index);
+    if (State::child_statuses[recipient_index] == 'u') {
+        State::num_urgent--;
+    }
+    State::child_statuses[recipient_index] = 'w';
+    State::num_requesting--;
+    send_work_to(pid_from_child_index(recipient_index), cnf, task_stack, interconnect);
+}
+
+// Sends one unit of work, stashed if we have any, to a rank
+void State::send_work_to(
+        short recipient_pid,
+        Cnf &cnf, 
+        Deque &task_stack, 
+        Interconnect &interconnect) 
+    {
     void *work;
+    int work_bytes;
     // Prefer to give stashed work
     if (interconnect.have_stashed_work()) {
+        Message stashed;
         if (interconnect.have_stashed_work(recipient_pid)) {
-            work = (interconnect.get_stashed_work(recipient_pid)).data;
+            stashed = interconnect.get_stashed_work(recipient_pid);
         } else {
-            work = (interconnect.get_stashed_work()).data;
+            stashed = interconnect.get_stashed_work();
         }
+        work = stashed.data;
+        work_bytes = stashed.size;
     } else {
         assert(task_stack.count > 0);
-        work = grab_work_from_stack(cnf, task_stack, recipient_pid);
+        int num_ints;
+        State::given_log_size_sum += estimate_oldest_subtree(cnf);
+        State::num_work_grabbed++;
+        work = grab_work_from_stack(cnf, task_stack, recipient_pid, &num_ints);
+        work_bytes = sizeof(unsigned int) * num_ints;
     }
-    if (State::child_statuses[recipient_index] == 'u') {
-        State::num_urgent--;
+    interconnect.send_work(recipient_pid, work, work_bytes);
+    State::work_balance++;
+    State::num_work_sent++;
+    State::work_bytes_sent += work_bytes;
+    if (!interconnect.shares_host(recipient_pid)) {
+        State::num_remote_work_sent++;
+        State::remote_work_bytes_sent += work_bytes;
     }
-    State::child_statuses[recipient_index] = 'w';
-    State::num_requesting--;
-    interconnect.send_work(recipient_pid, work);
+    // Pruned edit groups are only freed once the thief has its work
+    cnf.free_retired_edit_groups();
+}
+
+// Picks the rank to steal from when stealing randomly
+short State::pick_steal_victim(Interconnect &interconnect) {
+    if (State::steal_mode == STEAL_NODE_FIRST) {
+        // Our host first, where the state does not cross the network
+        bool look_further = interconnect.host_peers.empty() 
+            || State::host_refusals >= STEAL_HOST_ATTEMPTS;
+        std::vector<short> &candidates = 
+            (look_further && !interconnect.other_host_ranks.empty()) 
+            ? interconnect.other_host_ranks : interconnect.host_peers;
+        return candidates[rand_r(&(State::steal_seed)) % candidates.size()];
+    }
+    short victim = rand_r(&(State::steal_seed)) % (State::nprocs - 1);
+    victim += (victim >= State::pid);
+    if (State::steal_mode == STEAL_TWO_CHOICES && State::nprocs > 2) {
+        // Power of two choices, by what each told us when it last refused
+        short other = rand_r(&(State::steal_seed)) % (State::nprocs - 2);
+        other += (other >= std::min(victim, State::pid));
+        other += (other >= std::max(victim, State::pid));
+        if (State::victim_loads[other] > State::victim_loads[victim]) {
+            victim = other;
+        }
+    }
+    return victim;
+}
+
+// Asks a random rank for work, unless a request is already out or we are
+// backing off after a refusal
+void State::steal_work(Interconnect &interconnect) {
+    if (State::steal_outstanding 
+        || std::chrono::steady_clock::now() < State::next_steal_at) {
+        return;
+    }
+    short victim = pick_steal_victim(interconnect);
+    if (PRINT_LEVEL > 0) printf("PID %d: stealing from %d\n", State::pid, victim);
+    if (!State::steal_started) {
+        State::steal_started = true;
+        State::steal_started_at = std::chrono::steady_clock::now();
+    }
+    interconnect.send_work_request(victim, 0);
+    State::steal_outstanding = true;
+    State::num_steal_attempts++;
+}
+
+// Gives a random stealer work, or refuses if we have none to spare
+void State::handle_steal_request(
+        short thief_pid,
+        Cnf &cnf,
+        Deque &task_stack, 
+        Interconnect &interconnect) 
+    {
+    double min_log_size = MIN_STEAL_LOG_SIZE;
+    if (State::steal_mode == STEAL_NODE_FIRST && !interconnect.shares_host(thief_pid)) {
+        // Only big enough tasks are worth shipping to another host
+        min_log_size = REMOTE_STEAL_LOG_SIZE;
+    }
+    if (!out_of_work() && can_give_work(cnf, task_stack, interconnect, min_log_size)) {
+        send_work_to(thief_pid, cnf, task_stack, interconnect);
+    } else {
+        interconnect.send_steal_refusal(
+            thief_pid, State::num_non_trivial_tasks + interconnect.num_stashed_work);
+    }
+}
+
+// Notes a refused steal and when to try again
+void State::handle_steal_refusal(Message message, Interconnect &interconnect) {
+    State::victim_loads[message.sender] = *((int *)message.data);
+    interconnect.release_buffer(message.data);
+    State::steal_outstanding = false;
+    State::num_steals_refused++;
+    if (interconnect.shares_host(message.sender)) {
+        State::host_refusals++;
+    } else {
+        // Back to our host, it may have work again by now
+        State::host_refusals = 0;
+    }
+    State::next_steal_at = std::chrono::steady_clock::now() 
+        + std::chrono::microseconds(State::steal_backoff);
+    State::steal_backoff = std::min(2 * State::steal_backoff, STEAL_BACKOFF_MAX_MICROSECONDS);
+}
+
+// Passes the termination token on once we are idle. Back at rank 0, it ends
+// the search if every rank stayed idle with no work in flight.
+void State::pass_termination_token(Deque &task_stack, Interconnect &interconnect) {
+    if (!State::holding_token || !out_of_work() || interconnect.have_stashed_work()) {
+        return;
+    }
+    int count = State::token_count + State::work_balance;
+    bool touched = State::token_touched || State::touched;
+    if (State::pid == 0) {
+        if (State::token_returned && !touched && count == 0) {
+            abort_exhausted(task_stack, interconnect);
+            return;
+        }
+        // Start another round, we add our count when it comes back
+        count = 0;
+        touched = false;
+    }
+    interconnect.send_termination_token((State::pid + 1) % State::nprocs, count, touched);
+    State::holding_token = false;
+    State::touched = false;
 }
 
 // Gets stashed work, returns true if any was grabbed
@@ -464,10 +683,11 @@ void State::ask_for_work(
     {
     assert(!interconnect.have_stashed_work());
     assert(State::num_urgent <= State::num_children);
-    if (should_implicit_abort()) {
+    if (random_stealing()) {
+        steal_work(interconnect);
+    } else if (should_implicit_abort()) {
         // Self abort
-        abort_others(interconnect);
-        abort_process(task_stack, interconnect);
+        abort_exhausted(task_stack, interconnect);
     } else if (should_forward_urgent_request()) {
         if (PRINT_LEVEL > 0) printf("PID %d: urgently asking for work\n", State::pid);
         // Send a single urgent work request
@@ -499,13 +719,23 @@ void State::ask_for_work(
     }
 }
 
-// Invalidates (erases) ones work
+// Invalidates (erases) ones work, as when work is refuted on arrival
 void State::invalidate_work(Deque &task_stack) {
-    assert(false); // unfinished
     State::num_non_trivial_tasks = 0;
     task_stack.free_data();
 }
 
+// Stops every rank once the search space is exhausted
+void State::abort_exhausted(Deque &task_stack, Interconnect &interconnect) {
+    // Ranks hear the broadcast at their next poll, the urgent requests
+    // still go out for any that are idle
+    interconnect.announce_exhaustion();
+    if (State::nprocs > 1 && !random_stealing() && should_implicit_abort()) {
+        abort_others(interconnect);
+    }
+    abort_process(task_stack, interconnect);
+}
+
 // Empties/frees data structures and immidiately returns
 void State::abort_process(
         Deque &task_stack, 
@@ -518,6 +748,7 @@ void State::abort_process(
     interconnect.free_interconnect();
     free(State::child_statuses);
     free(State::requests_sent);
+    free(State::victim_loads);
     (*State::thieves).free_deque();
     free(State::thieves);
     task_stack.free_deque();
@@ -526,13 +757,8 @@ void State::abort_process(
 // Sends messages to children to force them to abort
 void State::abort_others(Interconnect &interconnect, bool explicit_abort) {
     if (explicit_abort) {
-        // Success, broadcase explicit abort to every process
-        for (short i = 0; i < State::nprocs; i++) {
-            if (i == State::pid) {
-                continue;
-            }
-            interconnect.send_abort_message(i);
-        }
+        // Success, every process hears it at its next poll
+        interconnect.announce_solution();
     } else {
         printf("PID %d: aborting others\n", State::pid);
         // Any children who did not receive an urgent request from us should
@@ -595,8 +821,7 @@ void State::handle_work_request(
             if (should_implicit_abort()) {
                 // Self-abort
                 printf("implicit abort from pid %d (in handle_work_request)\n", pid);
-                abort_others(interconnect);
-                abort_process(task_stack, interconnect);
+                abort_exhausted(task_stack, interconnect);
             } else if (should_forward_urgent_request()) {
                 // Send a single urgent work request
                 short dest_index = pick_request_recipient();
@@ -624,18 +849,42 @@ void State::handle_work_message(
     {
     if (PRINT_LEVEL > 0) printf("PID %d: handling work message\n", State::pid);
     short sender_pid = message.sender;
-    short child_index = child_index_from_pid(sender_pid);
     void *work = message.data;
-    assert(child_statuses[child_index] != 'u');
     assert(!interconnect.have_stashed_work(sender_pid));
+    if (random_stealing()) {
+        State::steal_outstanding = false;
+        State::steal_backoff = STEAL_BACKOFF_MICROSECONDS;
+        State::host_refusals = 0;
+        if (State::steal_started) {
+            State::steal_wait_total += std::chrono::duration_cast<std::chrono::duration<double>>(
+                std::chrono::steady_clock::now() - State::steal_started_at).count();
+            State::num_steals_won++;
+            State::steal_started = false;
+        }
+    } else {
+        short child_index = child_index_from_pid(sender_pid);
+        assert(child_statuses[child_index] != 'u');
+        State::requests_sent[child_index] = 'n';
+    }
     if (out_of_work()) {
         // Reconstruct state from work
-        Task task = cnf.extract_task_from_work(work);
+        int num_ints = message.size / sizeof(unsigned int);
+        Task task = cnf.extract_task_from_work(work, num_ints);
+        std::vector<Clause> bundled_clauses = cnf.extract_clauses_from_work(work, num_ints);
         State::current_task.assignment = task.assignment;
         State::current_task.var_id = task.var_id;
         // NICE: implement forwarding
         State::current_task.pid = sender_pid;
-        cnf.reconstruct_state(work, task_stack);
+        State::work_received_at = std::chrono::steady_clock::now();
+        if (!cnf.reconstruct_state(work, num_ints, task_stack)) {
+            interconnect.release_buffer(work);
+        }
+        State::reconstruct_time += std::chrono::duration_cast<std::chrono::duration<double>>(
+            std::chrono::steady_clock::now() - State::work_received_at).count();
+        State::num_reconstructs++;
+        State::num_incremental_reconstructs += cnf.last_reconstruct_incremental;
+        State::awaiting_first_decision = true;
+        State::num_leaves = 0; // depths restart from the new work
         (*State::thieves).free_data();
 
         // apply task immediately so we cant backtrack out
@@ -651,8 +900,14 @@ void State::handle_work_message(
                 cnf.true_assignment_statuses[task.var_id] = 'u';
                 cnf.false_assignment_statuses[task.var_id] = 'r';
             }
+            // Our share of the search lies under the task, so it joins the cube
+            cnf.add_to_cube(task.var_id);
+            add_bundled_clauses(cnf, task_stack, bundled_clauses);
             add_tasks_from_formula(cnf, task_stack);
         } else {
+            for (Clause clause : bundled_clauses) {
+                free_clause(clause);
+            }
             invalidate_work(task_stack);
         }
         
@@ -661,7 +916,6 @@ void State::handle_work_message(
         // Add to interconnect work stash
         interconnect.stash_work(message);
     }
-    State::requests_sent[child_index] = 'n';
 }
 
 // Handles an abort message, possibly forwarding it
@@ -677,32 +931,50 @@ void State::handle_message(
     assert(State::num_requesting <= State::num_children + 1);
     switch (message.type) {
         case 3: {
+            // Counted here, as stashed work is handled again when used
+            State::work_balance--;
+            State::touched = true;
             handle_work_message(
                 message, cnf, task_stack, interconnect);
             return;
         } case 4: {
+            // Released first, aborting tears the interconnect down
+            interconnect.release_buffer(message.data);
             abort_process(task_stack, interconnect, true);
-            free(message.data);
             return;
         } case 5: {
+            interconnect.release_buffer(message.data);
             invalidate_work(task_stack);
-            free(message.data);
             return;
         } case 6: {
             assert(SEND_CONFLICT_CLAUSES);
-            Clause conflict_clause = message_to_clause(message);
-            handle_remote_conflict_clause(
-                cnf, 
-                task_stack, 
-                conflict_clause, 
-                interconnect);
-            free(message.data);
+            short origin;
+            std::vector<Clause> received = message_to_clauses(message, &origin);
+            interconnect.release_buffer(message.data);
+            handle_remote_conflict_clauses(
+                cnf, task_stack, received, origin, message.sender, interconnect);
+            return;
+        } case 7: {
+            handle_steal_refusal(message, interconnect);
+            return;
+        } case 8: {
+            int *token = (int *)message.data;
+            State::token_count = token[0];
+            State::token_touched = token[1];
+            interconnect.release_buffer(message.data);
+            State::holding_token = true;
+            State::token_returned = (State::pid == 0);
             return;
         } default: {
             // 0, 1, or 2
+            interconnect.release_buffer(message.data);
+            if (random_stealing()) {
+                assert(message.type == 0);
+                handle_steal_request(message.sender, cnf, task_stack, interconnect);
+                return;
+            }
             handle_work_request(
                 message.sender, message.type, cnf, task_stack, interconnect);
-            free(message.data);
             return;
         }
     }
@@ -904,6 +1176,27 @@ void State::add_conflict_clause(
     if (PRINT_LEVEL > 2) cnf.print_task_stack("With conflict clause", task_stack);
 }
 
+// Adds the conflict clauses that came with work, unless already known or
+// decided by the state the work starts from
+void State::add_bundled_clauses(
+        Cnf &cnf, 
+        Deque &task_stack, 
+        std::vector<Clause> &bundled_clauses) 
+    {
+    for (Clause clause : bundled_clauses) {
+        int num_unsat;
+        bool has_room = cnf.clauses.num_conflict_indexed < cnf.clauses.max_conflict_indexable;
+        if (has_room 
+            && !cnf.clause_exists_already(clause) 
+            && cnf.check_clause(clause, &num_unsat) == 'n') {
+            add_conflict_clause(cnf, clause, task_stack, false, false);
+            State::num_bundled_clauses_added++;
+        } else {
+            free_clause(clause);
+        }
+    }
+}
+
 // Handles the current REMOTE conflict clause
 void State::handle_remote_conflict_clause(
         Cnf &cnf, 
@@ -1079,40 +1372,37 @@ void State::handle_local_conflict_clause(
     if (PRINT_LEVEL > 2) cnf.print_task_stack("Updated", task_stack);
     if (SEND_CONFLICT_CLAUSES && send && conflict_clause.num_literals < SEND_CONFLICT_CLAUSE_LIMIT * cnf.n) {
         if (PRINT_LEVEL > 1) printf("%sPID %d: sent conflict clause: %s\n", cnf.depth_str.c_str(), State::pid, cnf.clause_to_string_current(conflict_clause, false).c_str());
-        interconnect.send_conflict_clause(-1, conflict_clause, true);
+        interconnect.queue_conflict_clause(conflict_clause);
     }
 }
 
-// Adds a clause indicating our entire assignment is invalid
-void State::add_failure_clause(Cnf &cnf, Interconnect &interconnect) {
-    // generate conflict clause
-    Clause cc_done;
-    std::vector<int> givens;
-    for (int i = 0; i < cnf.num_variables; i++) {
-        if (cnf.assignment_times[i] == -1) {
-            givens.push_back(i);
+// Handles REMOTE conflict clauses learned by origin and received from
+// sender, passing on the ones not seen before
+void State::handle_remote_conflict_clauses(
+        Cnf &cnf, 
+        Deque &task_stack, 
+        std::vector<Clause> &received,
+        short origin,
+        short sender,
+        Interconnect &interconnect)
+    {
+    std::vector<Clause> conflict_clauses;
+    for (Clause conflict_clause : received) {
+        if (interconnect.clause_seen(conflict_clause)) {
+            free_clause(conflict_clause);
+        } else {
+            conflict_clauses.push_back(conflict_clause);
         }
     }
-    cc_done.num_literals = givens.size();
-    cc_done.literal_variable_ids = (int *)malloc(sizeof(int) * givens.size());
-    cc_done.literal_signs = (bool *)calloc(sizeof(bool), givens.size()); //all false
-    for (int i = 0; i < givens.size(); i++) {
-        cc_done.literal_variable_ids[i] = givens[i];
-    }
-
-    int new_clause_id = cnf.clauses.max_indexable + cnf.clauses.num_conflict_indexed;
-    cc_done.id = new_clause_id;
-    for (int lit = 0; lit < cc_done.num_literals; lit++) {
-        int var_id = cc_done.literal_variable_ids[lit];
-        bool sgn = cc_done.literal_signs[lit];
-        // negative means neg occurence of literal
-        int pm_id = sgn ? new_clause_id : -(new_clause_id+1);
-        (*((cnf.variables[var_id]).clauses_containing)).push_back(pm_id);
-    }
-    cnf.clauses.add_conflict_clause(cc_done);
-    cnf.clause_hash.insert(cc_done);
-    if (SEND_CONFLICT_CLAUSES) {
-        interconnect.send_conflict_clause(-1, cc_done, true);
+    // Before handling, which may free them
+    interconnect.forward_conflict_clauses(
+        conflict_clauses, origin, sender);
+    for (Clause conflict_clause : conflict_clauses) {
+        handle_remote_conflict_clause(
+            cnf, 
+            task_stack, 
+            conflict_clause, 
+            interconnect);
     }
 }
 
@@ -1223,6 +1513,11 @@ bool State::solve_iteration(
         Interconnect &interconnect) 
     {
     State::calls_to_solve++;
+    if (State::awaiting_first_decision) {
+        State::time_to_first_decision += std::chrono::duration_cast<std::chrono::duration<double>>(
+            std::chrono::steady_clock::now() - State::work_received_at).count();
+        State::awaiting_first_decision = false;
+    }
     assert(State::num_non_trivial_tasks > 0);
     assert(task_stack_invariant(cnf, task_stack, State::num_non_trivial_tasks));
     if (PRINT_LEVEL >= 3) printf("\n");
@@ -1246,8 +1541,7 @@ bool State::solve_iteration(
     }
     if ((State::current_cycle % CYCLES_TO_PRINT_PROGRESS == 0) && PRINT_PROGRESS) {
         print_progress(cnf, task_stack);
-        if (State::current_cycle == std::max(
-            CYCLES_TO_PRINT_PROGRESS, CYCLES_TO_RECEIVE_MESSAGES)) {
+        if (State::current_cycle == CYCLES_TO_PRINT_PROGRESS) {
             State::current_cycle = 0;
         }
     }
@@ -1259,6 +1553,13 @@ bool State::solve_iteration(
             var_id, assignment, implier, &conflict_id);
         if (!propagate_result) {
             print_data(cnf, task_stack, "Prop fail");
+            if (State::at_formula_root) {
+                // Follows from the formula alone, an empty clause
+                print_data(cnf, task_stack, "Root conflict");
+                abort_exhausted(task_stack, interconnect);
+                return false;
+            }
+            record_leaf(cnf.depth);
             if (ENABLE_CONFLICT_RESOLUTION && task_stack.count > 0) {
                 bool resolution_result = cnf.conflict_resolution_uid(
                     conflict_id, conflict_clause, decided_var_id);
@@ -1297,6 +1598,7 @@ bool State::solve_iteration(
         }
         if (PRINT_LEVEL > 3) print_data(cnf, task_stack, "Loop end");
         int num_added = add_tasks_from_formula(cnf, task_stack);
+        State::at_formula_root &= (num_added == 1);
         if (num_added == 1) {
             Task task = get_task(task_stack);
             var_id = task.var_id;
@@ -1316,8 +1618,16 @@ bool State::solve_iteration(
 // Continues solve operation, returns true iff a solution was found by
 // the current thread.
 bool State::solve(Cnf &cnf, Deque &task_stack, Interconnect &interconnect) {
+    State::solve_start = std::chrono::steady_clock::now();
+    State::last_poll = State::solve_start;
+    interconnect.post_receives(cnf.max_message_bytes());
+    interconnect.open_clause_window((int)(SEND_CONFLICT_CLAUSE_LIMIT * cnf.n));
+    interconnect.discover_topology();
+    interconnect.open_shared_memory((int)(SEND_CONFLICT_CLAUSE_LIMIT * cnf.n));
+    interconnect.open_termination();
+    interconnect.start_progress_thread();
     if (interconnect.pid == 0) {
-        add_tasks_from_formula(cnf, task_stack);
+        State::at_formula_root = (add_tasks_from_formula(cnf, task_stack) == 1);
         assert(task_stack.count > 0);
     }
 
@@ -1331,37 +1641,84 @@ bool State::solve(Cnf &cnf, Deque &task_stack, Interconnect &interconnect) {
                 ask_for_work(cnf, task_stack, interconnect);
             }
         }
+        if (out_of_work()) {
+            // Nothing learned should wait while we idle
+            interconnect.flush_conflict_clauses(true);
+        }
         Message message;
+        bool idled = out_of_work();
         while (out_of_work() && !State::process_finished) {
             bool message_received = interconnect.async_receive_message(message);
             if (message_received) {
                 handle_message(message, cnf, task_stack, interconnect);
+            } else if (interconnect.termination_announced()) {
+                abort_process(task_stack, interconnect, !interconnect.search_exhausted);
+            } else if (random_stealing()) {
+                // Idle, so the token can move on, and refusals back off
+                pass_termination_token(task_stack, interconnect);
+                if (!State::process_finished) {
+                    steal_work(interconnect);
+                }
+            } else if (interconnect.progress_thread != NULL) {
+                // Leave the core to the thread doing the receiving
+                std::this_thread::yield();
             }
         }
         if (State::process_finished) break;
+        if (idled) {
+            // Idle time says nothing about how long iterations take
+            State::iterations_since_poll = 0;
+            State::messages_since_poll = 0;
+            State::last_poll = std::chrono::steady_clock::now();
+        }
         bool result = solve_iteration(cnf, task_stack, interconnect);
+        if (State::process_finished) break;
         if (result) {
             assert(State::num_non_trivial_tasks >= 0);
             abort_others(interconnect, true);
             abort_process(task_stack, interconnect, true);
             return true;
-        } else if (out_of_work()) {
-            add_failure_clause(cnf, interconnect);
+        }
+        if (interconnect.pulls_clauses() && !out_of_work() 
+            && cnf.edit_stack.count <= CLAUSE_PULL_DEPTH 
+            && interconnect.clause_pull_due()) {
+            // Back near the root, a cheap point to take in peers' clauses
+            std::vector<Clause> pulled;
+            interconnect.pull_conflict_clauses(pulled);
+            handle_remote_conflict_clauses(
+                cnf, task_stack, pulled, -1, -1, interconnect);
         }
 
-        if (current_cycle % CYCLES_TO_RECEIVE_MESSAGES == 1) { // dish messages first
+        if (interconnect.progress_thread != NULL) {
+            // Already received, so checking every iteration is cheap
             while (interconnect.async_receive_message(message) && !State::process_finished) {
                 handle_message(message, cnf, task_stack, interconnect);
+                State::messages_since_poll++;
+            }
+            if (State::process_finished) break;
+        }
+        State::iterations_since_poll++;
+        if (State::iterations_since_poll >= State::poll_interval) { // dish messages first
+            while (interconnect.async_receive_message(message) && !State::process_finished) {
+                handle_message(message, cnf, task_stack, interconnect);
+                State::messages_since_poll++;
                 // NICE: serve work here?
             }
             if (State::process_finished) break;
-            if (State::current_cycle == std::max(
-                CYCLES_TO_PRINT_PROGRESS, CYCLES_TO_RECEIVE_MESSAGES)) {
-                State::current_cycle = 0;
+            if (interconnect.termination_announced()) {
+                abort_process(task_stack, interconnect, !interconnect.search_exhausted);
+                break;
+            }
+            schedule_next_poll();
+            interconnect.flush_conflict_clauses(false);
+            if (State::time_limit > 0 && std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - State::solve_start).count() > State::time_limit) {
+                State::timed_out = true;
+                interconnect.stop_progress_thread();
+                return false;
             }
         }
         if (!out_of_work()) { // Serve ourselves before others
-            while (workers_requesting() && can_give_work(task_stack, interconnect)) {
+            while (workers_requesting() && can_give_work(cnf, task_stack, interconnect)) {
                 give_work(cnf, task_stack, interconnect);
             }
         }
@@ -2,11 +2,21 @@
 #define STATE_H
 
 #include <cstdint>
+#include <chrono>
 #include <string>
 #include "helpers.h"
 #include "interconnect.h"
 #include "cnf.h"
 
+// Whom an idle rank asks for work
+#define STEAL_TREE 0 // its parent and children in the work tree
+#define STEAL_RANDOM 1 // any rank, uniformly at random
+#define STEAL_TWO_CHOICES 2 // the more loaded of two random ranks
+#define STEAL_NODE_FIRST 3 // a random rank on its host, then on other hosts
+
+// Returns the steal mode named, or -1 if there is none by that name
+short steal_mode_from_name(std::string name);
+
 class State {
     public:
         short pid;
@@ -34,11 +44,70 @@ class State {
         // 2 always set True
         // 3 always set False
         int current_cycle;
+        // Whether we are still propagating the whole formula's units, before
+        // any decision or steal, where a conflict proves there is no solution
+        bool at_formula_root;
+        // Polls are spaced in time, poll_interval iterations estimated to
+        // take about POLL_TARGET_MICROSECONDS
+        int poll_interval;
+        int iterations_since_poll;
+        int messages_since_poll;
+        double iteration_microseconds; // running average per iteration
+        double message_rate; // running average arrivals per microsecond
+        std::chrono::steady_clock::time_point last_poll;
+        int num_polls;
+        double poll_microseconds_total;
+        long long poll_iterations_total;
+        // Seconds solve may run for before giving up, 0 means no limit
+        double time_limit;
+        bool timed_out;
+        std::chrono::steady_clock::time_point solve_start;
+        // Steal figures, printed with PRINT_STEAL_STATS
+        int num_reconstructs;
+        int num_incremental_reconstructs;
+        double reconstruct_time;
+        double time_to_first_decision;
+        bool awaiting_first_decision;
+        std::chrono::steady_clock::time_point work_received_at;
+        int num_work_sent;
+        long long work_bytes_sent;
+        int num_remote_work_sent; // to other hosts
+        long long remote_work_bytes_sent;
+        int num_bundled_clauses_added;
+        int num_work_grabbed;
+        double given_log_size_sum;
+        // Running average depth of the conflicts reached since the last work
+        int num_leaves;
+        double mean_leaf_depth;
         Deque *thieves;
         GivenTask current_task;
 
         short last_asked_child;
 
+        short steal_mode;
+        // Random stealing keeps one request out at a time, backing off
+        // after each refusal
+        bool steal_outstanding;
+        int steal_backoff; // microseconds
+        std::chrono::steady_clock::time_point next_steal_at;
+        unsigned int steal_seed;
+        int *victim_loads; // tasks each rank held when it last refused us
+        int num_steal_attempts;
+        int num_steals_refused;
+        int host_refusals; // in a row, from ranks on our host
+        bool steal_started; // since we last received work
+        std::chrono::steady_clock::time_point steal_started_at;
+        double steal_wait_total;
+        int num_steals_won;
+        // Without a tree to count idle ranks up, termination is detected by
+        // passing a token round the ranks (Safra's algorithm)
+        int work_balance; // work messages sent less those received
+        bool touched; // received work since we last passed the token
+        bool holding_token;
+        bool token_returned; // on rank 0, back from a round
+        int token_count;
+        bool token_touched;
+
         State(
             short pid, 
             short nprocs, 
@@ -57,14 +126,33 @@ class State {
         // Returns whether there are any other processes requesting our work
         bool workers_requesting();
 
+        // Returns whether idle ranks steal from random ranks rather than
+        // their tree neighbours
+        bool random_stealing();
+
         // Returns whether we should forward an urgent request
         bool should_forward_urgent_request();
 
         // Returns whether we should implicitly abort due to urgent requests
         bool should_implicit_abort();
 
-        // Returns whether the state is able to supply work to requesters
-        bool can_give_work(Deque task_stack, Interconnect interconnect);
+        // Returns whether the state is able to supply work to requesters,
+        // declining tasks estimated under 2^min_log_size nodes
+        bool can_give_work(
+            Cnf &cnf, 
+            Deque &task_stack, 
+            Interconnect &interconnect,
+            double min_log_size = MIN_STEAL_LOG_SIZE);
+
+        // Estimates log2 of the number of nodes under the oldest open task
+        double estimate_oldest_subtree(Cnf &cnf);
+
+        // Adds a conflict depth to the running leaf depth average
+        void record_leaf(int depth);
+
+        // Picks the iterations to run before the next poll from how long
+        // they take, the messages arriving, and the requests pending on us
+        void schedule_next_poll();
 
         // Ensures the task stack is a valid one, returns result
         bool task_stack_invariant(
@@ -72,17 +160,12 @@ class State {
             Deque &task_stack, 
             int supposed_num_tasks);
         
-        // Applies an edit to the given compressed CNF
-        void apply_edit_to_compressed(
-            Cnf &cnf, 
-            unsigned int *compressed,
-            FormulaEdit edit);
-        
         // Grabs work from the top of the task stack, updates Cnf structures
         void *grab_work_from_stack(
             Cnf &cnf, 
             Deque &task_stack, 
-            short recipient_pid);
+            short recipient_pid,
+            int *num_ints);
         
         // Picks recipient index to give work to
         short pick_work_recipient();
@@ -95,6 +178,34 @@ class State {
             Cnf &cnf, 
             Deque &task_stack, 
             Interconnect &interconnect);
+
+        // Sends one unit of work, stashed if we have any, to a rank
+        void send_work_to(
+            short recipient_pid,
+            Cnf &cnf, 
+            Deque &task_stack, 
+            Interconnect &interconnect);
+
+        // Picks the rank to steal from when stealing randomly
+        short pick_steal_victim(Interconnect &interconnect);
+
+        // Asks a random rank for work, unless a request is already out or
+        // we are backing off after a refusal
+        void steal_work(Interconnect &interconnect);
+
+        // Gives a random stealer work, or refuses if we have none to spare
+        void handle_steal_request(
+            short thief_pid,
+            Cnf &cnf,
+            Deque &task_stack, 
+            Interconnect &interconnect);
+
+        // Notes a refused steal and when to try again
+        void handle_steal_refusal(Message message, Interconnect &interconnect);
+
+        // Passes the termination token on once we are idle. Back at rank 0,
+        // it ends the search if every rank stayed idle with no work in flight.
+        void pass_termination_token(Deque &task_stack, Interconnect &interconnect);
         
         // Gets stashed work, returns true if any was grabbed
         bool get_work_from_interconnect_stash(
@@ -105,6 +216,9 @@ class State {
         // Returns whether we are out of work to do
         bool out_of_work();
 
+        // Stops every rank once the search space is exhausted
+        void abort_exhausted(Deque &task_stack, Interconnect &interconnect);
+
         // Asks parent or children for work, called once when we finish our work
         void ask_for_work(
             Cnf &cnf, 
@@ -186,6 +300,13 @@ class State {
                 Interconnect &interconnect,
                 bool send=true);
 
+        // Adds the conflict clauses that came with work, unless already known
+        // or decided by the state the work starts from
+        void add_bundled_clauses(
+            Cnf &cnf, 
+            Deque &task_stack, 
+            std::vector<Clause> &bundled_clauses);
+
         // Handles the current REMOTE conflict clause
         void handle_remote_conflict_clause(
                 Cnf &cnf, 
@@ -193,8 +314,15 @@ class State {
                 Clause conflict_clause,
                 Interconnect &interconnect);
 
-        // Adds a clause indicating our entire assignment is invalid
-        void add_failure_clause(Cnf &cnf, Interconnect &interconnect);
+        // Handles REMOTE conflict clauses learned by origin and received
+        // from sender, passing on the ones not seen before
+        void handle_remote_conflict_clauses(
+                Cnf &cnf, 
+                Deque &task_stack, 
+                std::vector<Clause> &received,
+                short origin,
+                short sender,
+                Interconnect &interconnect);
 
         // Adds one or two variable assignment tasks to task stack
         int add_tasks_from_formula(Cnf &cnf, Deque &task_stack);